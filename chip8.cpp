@@ -2,13 +2,80 @@
 #include <fstream>
 #include <chrono>
 #include <random>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <csignal>
+#include <sstream>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <queue>
+#include <coroutine>
+#include <ctime>
+#include <cstring>
+#include <cstddef>
+#include <bit>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <dirent.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CHIP8_HAVE_AVX2_KERNELS 1
+#define CHIP8_HAVE_RDTSC 1
+#endif
+#include <cmath>
+
+//Guaranteed tail calls for the threaded interpreter; without them it relies on sibling-call optimization
+#if defined(__clang__)
+#define CHIP8_MUSTTAIL [[clang::musttail]]
+#define CHIP8_HAVE_MUSTTAIL 1
+#elif defined(__GNUC__) && __GNUC__ >= 15
+#define CHIP8_MUSTTAIL [[gnu::musttail]]
+#define CHIP8_HAVE_MUSTTAIL 1
+#else
+#define CHIP8_MUSTTAIL
+#endif
+
+//Per-address memory access counters, compiled in with -DCHIP8_MEMORY_HEATMAP
+#ifdef CHIP8_MEMORY_HEATMAP
+#define HEATMAP_COUNT(kind, address) (++heatmap.kind[(address) & 0xFFFu])
+#else
+#define HEATMAP_COUNT(kind, address) ((void)0)
+#endif
 #include <SDL2/SDL.h>
 
 const unsigned int START_ADDRESS = 0x200;
+//Guest addresses are 12 bits; every access is masked so none can leave memory
+const unsigned int ADDRESS_MASK = 0xFFF;
 const unsigned int FONTSET_START_ADDRESS = 0x50;
 const unsigned int FONTSET_SIZE = 80;
 const unsigned int VIDEO_HEIGHT = 32;
 const unsigned int VIDEO_WIDTH = 64;
+const unsigned int TIMER_HZ = 60;
+const unsigned int PACKED_FRAME_SIZE = VIDEO_WIDTH * VIDEO_HEIGHT / 8;
+
+//COSMAC VIP timing, in machine cycles (8 clocks of the 1.7609 MHz CDP1802)
+const unsigned int VIP_CYCLES_PER_FRAME = 3668;
+//Cycles the CDP1861 takes per frame: 1024 DMA bytes plus its interrupt routine
+const unsigned int VIP_DISPLAY_CYCLES = 1024 + 46;
+//Interpreter overhead to fetch and decode any instruction
+const unsigned int VIP_FETCH_CYCLES = 40;
 
 //Sprites for characters
 uint8_t fontset[FONTSET_SIZE] =
@@ -31,33 +98,164 @@ uint8_t fontset[FONTSET_SIZE] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+/**
+ * Source of time for the run loop and frontends. Anything that paces,
+ * times out or measures latency asks a Clock rather than steady_clock,
+ * so tests can run on virtual time.
+ */
+class Clock {
+  public:
+    typedef std::chrono::nanoseconds Duration;
+
+    virtual ~Clock() {}
+
+    //Time since a clock-specific epoch
+    virtual Duration Now() = 0;
+
+    //Blocks until Now() has reached the deadline
+    virtual void SleepUntil(Duration deadline) = 0;
+};
+
+/**
+ * Wall-clock time from steady_clock.
+ */
+class RealClock : public Clock {
+  public:
+    Duration Now() override {
+      return std::chrono::duration_cast<Duration>(std::chrono::steady_clock::now().time_since_epoch());
+    }
+
+    void SleepUntil(Duration deadline) override {
+      Duration remaining = deadline - Now();
+      if (remaining > Duration::zero()) {
+        std::this_thread::sleep_for(remaining);
+      }
+    }
+};
+
+/**
+ * Manually advanced time. Sleeping never blocks, it just jumps the clock
+ * to the deadline, so an hour of paced emulation takes as long as the
+ * emulation work itself and is fully deterministic.
+ */
+class VirtualClock : public Clock {
+  public:
+    VirtualClock() : now(0) {}
+
+    Duration Now() override {
+      return Duration(now.load());
+    }
+
+    void SleepUntil(Duration deadline) override {
+      Duration::rep current = now.load();
+      while (deadline.count() > current && !now.compare_exchange_weak(current, deadline.count())) {
+      }
+    }
+
+    void Advance(Duration delta) {
+      now += delta.count();
+    }
+
+  private:
+    std::atomic<Duration::rep> now;
+};
+
+/**
+ * Runs another clock faster or slower by a constant factor, e.g. a
+ * scale of 10 makes one real second look like ten.
+ */
+class ScaledClock : public Clock {
+  public:
+    ScaledClock(Clock& base, double scale) : base(base), scale(scale), origin(base.Now()) {}
+
+    Duration Now() override {
+      return Duration(static_cast<Duration::rep>((base.Now() - origin).count() * scale));
+    }
+
+    void SleepUntil(Duration deadline) override {
+      base.SleepUntil(origin + Duration(static_cast<Duration::rep>(deadline.count() / scale)));
+    }
+
+  private:
+    Clock& base;
+    double scale;
+    Duration origin;
+};
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+//Folds bytes into an FNV-1a hash
+uint64_t Fnv1a(uint64_t hash, void const* data, size_t size) {
+  uint8_t const* bytes = static_cast<uint8_t const*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+//FNV-1a hash of a video buffer, for detecting and comparing frames
+uint64_t FrameHash(uint32_t const* video) {
+  return Fnv1a(FNV_OFFSET_BASIS, video, VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(uint32_t));
+}
+
+//Host keys for CHIP-8 keys 0-F, as handled by Platform::ProcessInput
+const SDL_Keycode KEYMAP[16] = {
+  SDLK_x, SDLK_1, SDLK_2, SDLK_3, SDLK_q, SDLK_w, SDLK_e, SDLK_a,
+  SDLK_s, SDLK_d, SDLK_z, SDLK_c, SDLK_4, SDLK_r, SDLK_f, SDLK_v
+};
+
+/**
+ * SDL frontend. Nothing is initialized until the first frame is
+ * presented, so short-lived and headless jobs never pay for SDL video,
+ * the window, the renderer or the texture.
+ */
 class Platform {
   public:
-    Chip8(char const* title, int windowWidth, int windowHeight, int textureWidth, int textureHeight) {
-      SDL_Init(SDL_INIT_VIDEO);
-      window = SDL_CreateWindow(title, 0, 0, windowWidth, windowHeight, SDL_WINDOW_SHOWN);
-      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-      texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
+    Platform(char const* title, int windowWidth, int windowHeight, int textureWidth, int textureHeight, Clock& clock)
+      : title(title), windowWidth(windowWidth), windowHeight(windowHeight), textureWidth(textureWidth),
+        textureHeight(textureHeight), clock(clock), lastPresent(0), vsync(false), window(nullptr), renderer(nullptr), texture(nullptr)
+    {
     }
 
-    ~Chip8() {
-      SDL_DestroyTexture(texture);
-      SDL_DestroyRenderer(renderer);
-      SDL_DestroyWindow(window);
-      SDL_Quit();
+    //Presents in step with the display; only takes effect before the first Update()
+    void SetVsync(bool enabled) {
+      vsync = enabled;
+    }
+
+    ~Platform() {
+      if (texture) SDL_DestroyTexture(texture);
+      if (renderer) SDL_DestroyRenderer(renderer);
+      if (window) SDL_DestroyWindow(window);
+      if (SDL_WasInit(SDL_INIT_VIDEO)) {
+        SDL_Quit();
+      }
     }
 
     void Update(void const* buffer, int pitch) {
+      if (!texture && !Open()) {
+        return;
+      }
       SDL_UpdateTexture(texture, nullptr, buffer, pitch);
       SDL_RenderClear(renderer);
       SDL_RenderCopy(renderer, texture, nullptr, nullptr);
       SDL_RenderPresent(renderer);
+      lastPresent = clock.Now();
+    }
+
+    //Clock time of the most recent present
+    Clock::Duration LastPresent() const {
+      return lastPresent;
     }
 
     bool ProcessInput(uint8_t* keys) {
       bool quit = false;
       SDL_Event event;
 
+      //No window yet, so no events to read
+      if (!window) {
+        return false;
+      }
+
       while (SDL_PollEvent(&event)) {
         switch (event.type) {
           
@@ -212,55 +410,471 @@ class Platform {
     }
   
   private:
-    
+    //Brings up SDL video, the window, the renderer and the texture
+    bool Open() {
+      if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0) {
+        return false;
+      }
+      window = SDL_CreateWindow(title, 0, 0, windowWidth, windowHeight, SDL_WINDOW_SHOWN);
+      renderer = window ? SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0)) : nullptr;
+      texture = renderer ? SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight) : nullptr;
+      return texture != nullptr;
+    }
+
+    char const* title;
+    int windowWidth;
+    int windowHeight;
+    int textureWidth;
+    int textureHeight;
+    Clock& clock;
+    Clock::Duration lastPresent;
+    bool vsync;
     SDL_Window* window;
     SDL_Renderer* renderer;
     SDL_Texture* texture;
 
 };
 
+/**
+ * How often each memory address was read as data (Dxyn sprite rows,
+ * Fx65), written (Fx33, Fx55) and executed (both opcode bytes).
+ *
+ * Only filled in builds with CHIP8_MEMORY_HEATMAP. The counters add one
+ * increment per access to the interpreter and 48 KiB to every Chip8;
+ * BenchmarkHeatmap measured up to about 10% fewer instructions per
+ * second on the synthetic ROMs (draw-bound ones barely move), so keep
+ * them out of production builds.
+ */
+struct MemoryHeatmap {
+  uint32_t reads[4096];
+  uint32_t writes[4096];
+  uint32_t executes[4096];
+
+  void Clear() {
+    memset(reads, 0, sizeof(reads));
+    memset(writes, 0, sizeof(writes));
+    memset(executes, 0, sizeof(executes));
+  }
+
+  //One row per address that was touched at all
+  bool WriteCsv(char const* filename) const {
+    std::ofstream file(filename, std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+    file << "address,reads,writes,executes\n";
+    for (unsigned int address = 0; address < 4096; ++address) {
+      if (reads[address] || writes[address] || executes[address]) {
+        file << address << ',' << reads[address] << ',' << writes[address] << ',' << executes[address] << '\n';
+      }
+    }
+    return file.good();
+  }
+
+  /**
+   * 64x64 binary PPM, one pixel per address in row-major order (0x000
+   * top left, 0x040 starts the second row). Red is writes, green reads,
+   * blue executes, each on a log scale against its own maximum.
+   */
+  bool WritePpm(char const* filename) const {
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+    file << "P6\n64 64\n255\n";
+    uint32_t const* channels[3] = {writes, reads, executes};
+    double scale[3];
+    for (unsigned int c = 0; c < 3; ++c) {
+      uint32_t peak = *std::max_element(channels[c], channels[c] + 4096);
+      scale[c] = peak ? 255.0 / std::log1p(static_cast<double>(peak)) : 0.0;
+    }
+    for (unsigned int address = 0; address < 4096; ++address) {
+      for (unsigned int c = 0; c < 3; ++c) {
+        file.put(static_cast<char>(static_cast<uint8_t>(std::log1p(static_cast<double>(channels[c][address])) * scale[c] + 0.5)));
+      }
+    }
+    return file.good();
+  }
+};
+
+const unsigned int MEMORY_SIZE = 4096;
+const unsigned int MEMORY_PAGE_SIZE = 256;
+const unsigned int MEMORY_PAGES = MEMORY_SIZE / MEMORY_PAGE_SIZE;
+
+/**
+ * One page of guest memory. A page is either private to one machine or
+ * interned, in which case every machine whose page had the same bytes
+ * points at it and it must not be written.
+ */
+struct MemoryPage {
+  uint8_t bytes[MEMORY_PAGE_SIZE];
+  std::atomic<uint32_t> refs;
+  uint64_t hash;
+  bool interned;
+};
+
+/**
+ * Process-wide table of interned pages, keyed by content hash and
+ * confirmed byte for byte. References to interned pages are only
+ * dropped under the lock, so a lookup never finds a page being freed.
+ */
+class PageInterner {
+  public:
+    static PageInterner& Global() {
+      static PageInterner interner;
+      return interner;
+    }
+
+    //Takes over a private page and returns the interned page with its bytes
+    MemoryPage* Intern(MemoryPage* page) {
+      page->hash = Fnv1a(FNV_OFFSET_BASIS, page->bytes, MEMORY_PAGE_SIZE);
+      std::lock_guard<std::mutex> lock(mutex);
+      auto range = table.equal_range(page->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (memcmp(it->second->bytes, page->bytes, MEMORY_PAGE_SIZE) == 0) {
+          it->second->refs.fetch_add(1, std::memory_order_relaxed);
+          delete page;
+          return it->second;
+        }
+      }
+      page->interned = true;
+      table.emplace(page->hash, page);
+      return page;
+    }
+
+    //Drops a reference to an interned page, freeing it with the last one
+    void Release(MemoryPage* page) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (page->refs.fetch_sub(1, std::memory_order_relaxed) != 1) {
+        return;
+      }
+      auto range = table.equal_range(page->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == page) {
+          table.erase(it);
+          break;
+        }
+      }
+      delete page;
+    }
+
+    size_t PageCount() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return table.size();
+    }
+
+    //Heap bytes of all interned pages, shared by every machine
+    size_t Bytes() {
+      return PageCount() * sizeof(MemoryPage);
+    }
+
+  private:
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, MemoryPage*> table;
+};
+
+//Lets a unique_ptr hold a reference to an interned page
+struct InternedPageRelease {
+  void operator()(MemoryPage* page) const {
+    PageInterner::Global().Release(page);
+  }
+};
+
+typedef std::unique_ptr<MemoryPage, InternedPageRelease> InternedPageRef;
+
+/**
+ * The 4 KiB guest address space as a table of 256-byte pages.
+ *
+ * Machines running the same ROM hold mostly identical memory (fonts,
+ * code, untouched zero pages), so Intern() swaps each private page for
+ * the interned copy of its bytes. Writing to an interned page first
+ * gives the machine a private copy, which the next Intern() folds back
+ * in if it matches something again. Reads cost one extra load through
+ * the page table; only writes check for sharing, against a bitmask of
+ * the interned pages kept next to the table.
+ *
+ * Addresses must already be below MEMORY_SIZE (see ADDRESS_MASK).
+ */
+class GuestMemory {
+  public:
+    explicit GuestMemory(uint8_t const* image) : shared(0) {
+      for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+        pages[p] = NewPage(image + p * MEMORY_PAGE_SIZE);
+      }
+      Intern();
+    }
+
+    GuestMemory(GuestMemory const& other) : shared(other.shared) {
+      for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+        pages[p] = Share(other.pages[p]);
+      }
+    }
+
+    GuestMemory& operator=(GuestMemory const& other) {
+      for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+        if (pages[p] != other.pages[p]) {
+          MemoryPage* page = Share(other.pages[p]);
+          Drop(pages[p]);
+          pages[p] = page;
+        }
+      }
+      shared = other.shared;
+      return *this;
+    }
+
+    ~GuestMemory() {
+      for (MemoryPage* page : pages) {
+        Drop(page);
+      }
+    }
+
+    uint8_t operator[](unsigned int address) const {
+      return pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE];
+    }
+
+    //Big-endian instruction word at address, wrapping at the end of memory
+    uint16_t Word(unsigned int address) const {
+      uint8_t const* bytes = pages[address / MEMORY_PAGE_SIZE]->bytes;
+      unsigned int offset = address % MEMORY_PAGE_SIZE;
+      if (offset != MEMORY_PAGE_SIZE - 1) {
+        return static_cast<uint16_t>((bytes[offset] << 8u) | bytes[offset + 1]);
+      }
+      return static_cast<uint16_t>((bytes[offset] << 8u) | (*this)[(address + 1) & (MEMORY_SIZE - 1)]);
+    }
+
+    void Write(unsigned int address, uint8_t value) {
+      if (shared & (1u << (address / MEMORY_PAGE_SIZE))) {
+        Unshare(address / MEMORY_PAGE_SIZE);
+      }
+      pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE] = value;
+    }
+
+    //Copies size bytes starting at address out; the range must not run past the end
+    void Read(unsigned int address, uint8_t* out, size_t size) const {
+      while (size) {
+        size_t chunk = std::min<size_t>(size, MEMORY_PAGE_SIZE - address % MEMORY_PAGE_SIZE);
+        memcpy(out, &pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE], chunk);
+        address += static_cast<unsigned int>(chunk);
+        out += chunk;
+        size -= chunk;
+      }
+    }
+
+    void Write(unsigned int address, uint8_t const* data, size_t size) {
+      while (size) {
+        size_t chunk = std::min<size_t>(size, MEMORY_PAGE_SIZE - address % MEMORY_PAGE_SIZE);
+        if (shared & (1u << (address / MEMORY_PAGE_SIZE))) {
+          Unshare(address / MEMORY_PAGE_SIZE);
+        }
+        memcpy(&pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE], data, chunk);
+        address += static_cast<unsigned int>(chunk);
+        data += chunk;
+        size -= chunk;
+      }
+    }
+
+    //The size bytes at address, or null if they cross a page boundary
+    uint8_t const* ReadSpan(unsigned int address, unsigned int size) const {
+      if (address % MEMORY_PAGE_SIZE + size > MEMORY_PAGE_SIZE) {
+        return nullptr;
+      }
+      return &pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE];
+    }
+
+    //Same, made private first so it can be written
+    uint8_t* WriteSpan(unsigned int address, unsigned int size) {
+      if (address % MEMORY_PAGE_SIZE + size > MEMORY_PAGE_SIZE) {
+        return nullptr;
+      }
+      if (shared & (1u << (address / MEMORY_PAGE_SIZE))) {
+        Unshare(address / MEMORY_PAGE_SIZE);
+      }
+      return &pages[address / MEMORY_PAGE_SIZE]->bytes[address % MEMORY_PAGE_SIZE];
+    }
+
+    //Read-only view of one page
+    uint8_t const* Page(unsigned int page) const {
+      return pages[page]->bytes;
+    }
+
+    //Shares every private page whose bytes some machine has already interned
+    void Intern() {
+      for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+        if (!pages[p]->interned) {
+          pages[p] = PageInterner::Global().Intern(pages[p]);
+        }
+      }
+      shared = (1u << MEMORY_PAGES) - 1;
+    }
+
+    //A new reference to the page if it is interned, keeping it alive after this memory is gone; null for a private page
+    InternedPageRef ShareInterned(unsigned int page) const {
+      if (!pages[page]->interned) {
+        return nullptr;
+      }
+      pages[page]->refs.fetch_add(1, std::memory_order_relaxed);
+      return InternedPageRef(pages[page]);
+    }
+
+    //Heap bytes of the pages only this machine holds
+    size_t PrivateBytes() const {
+      size_t bytes = 0;
+      for (MemoryPage const* page : pages) {
+        bytes += page->interned ? 0 : sizeof(MemoryPage);
+      }
+      return bytes;
+    }
+
+  private:
+    static MemoryPage* NewPage(uint8_t const* bytes) {
+      MemoryPage* page = new MemoryPage;
+      memcpy(page->bytes, bytes, MEMORY_PAGE_SIZE);
+      page->refs.store(1, std::memory_order_relaxed);
+      page->hash = 0;
+      page->interned = false;
+      return page;
+    }
+
+    static MemoryPage* Share(MemoryPage* page) {
+      if (!page->interned) {
+        return NewPage(page->bytes);
+      }
+      page->refs.fetch_add(1, std::memory_order_relaxed);
+      return page;
+    }
+
+    static void Drop(MemoryPage* page) {
+      if (page->interned) {
+        PageInterner::Global().Release(page);
+      } else {
+        delete page;
+      }
+    }
+
+    //Replaces an interned page with a private copy before it is written
+    void Unshare(unsigned int index) {
+      MemoryPage* page = pages[index];
+      pages[index] = NewPage(page->bytes);
+      PageInterner::Global().Release(page);
+      shared &= ~(1u << index);
+    }
+
+    MemoryPage* pages[MEMORY_PAGES];
+    uint32_t shared; // bit per interned page
+};
+
+/**
+ * Host calls for test and benchmark ROMs, encoded as SYS 0Fxk: k picks
+ * the call and x is its operand. SYS is otherwise ignored here, so a
+ * ROM using them runs unchanged where no handler is attached. The low
+ * nibble never uses 0 or E, which table0 decodes as CLS and RET.
+ */
+enum HostCall {
+  HOST_BEGIN = 0x1,   // enter region x
+  HOST_END = 0x2,     // leave region x
+  HOST_COUNT = 0x3,   // counter x += 1
+  HOST_ADD = 0x4,     // counter x += Vx
+  HOST_ASSERT = 0x5,  // Vx must equal the byte at I
+  HOST_SNAPSHOT = 0x6 // snapshot the machine, tagged x
+};
+
+inline bool IsHostCall(uint16_t opcode) {
+  return (opcode & 0xFF00u) == 0x0F00u && (opcode & 0xFu) >= HOST_BEGIN && (opcode & 0xFu) <= HOST_SNAPSHOT;
+}
+
+class Chip8;
+
+//Receives the host calls of a Chip8 it is attached to
+class HostCallHandler {
+  public:
+    virtual ~HostCallHandler() = default;
+    virtual void OnHostCall(Chip8& chip8, HostCall call, uint8_t operand) = 0;
+};
+
+/**
+ * Flat copy of everything that determines how a Chip8 continues, for
+ * checkpoints. The RNG is stored in its textual stream form.
+ */
+struct Chip8State {
+  uint8_t registers[16];
+  uint8_t memory[MEMORY_SIZE];
+  uint16_t index;
+  uint16_t pc;
+  uint16_t stack[16];
+  uint8_t sp;
+  uint8_t delayTimer;
+  uint8_t soundTimer;
+  uint8_t keypad[16];
+  uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT];
+  int32_t cycleCarry;
+  char rng[32];
+};
+
 class Chip8 {
 
   public:
 
     //Components of CHIP-8
-    uint8_t registers[16];
-    uint8_t memory[4096];
-    uint16_t index;
-    uint16_t pc;
-    uint16_t stack[16];
-    uint8_t sp;
-    uint8_t delayTimer;
-    uint8_t soundTimer;
-    uint8_t keypad[16];
-    uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT];
-    uint16_t opcode;
+    uint8_t registers[16]{};
+    GuestMemory memory; // starts out as the interned BootImage() pages
+    uint16_t index{};
+    uint16_t pc{};
+    uint16_t stack[16]{};
+    uint8_t sp{};
+    uint8_t delayTimer{};
+    uint8_t soundTimer{};
+    uint8_t keypad[16]{};
+    uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT]{};
+    uint16_t opcode{};
+    int32_t cycleCarry{}; // VIP machine cycles overspent (negative) from the previous frame
+    HostCallHandler* hostCalls{}; // opt-in; SYS 0nnn is a no-op while null
+    uint64_t romHash{}; // FNV-1a of the last ROM loaded, as RomIndex keys it
+#ifdef CHIP8_MEMORY_HEATMAP
+    MemoryHeatmap heatmap{};
+#endif
 
     //Helper member variables
-    std::default_random_engine randGen;
+    std::minstd_rand0 randGen;
     std::uniform_int_distribution<uint8_t> randByte;
 
     //Constructor
-    Chip8() : randGen(std::chrono::system_clock::now().time_since_epoch().count())
+    Chip8() : Chip8(std::chrono::system_clock::now().time_since_epoch().count()) {}
+
+    //Constructor with a fixed RNG seed, for reproducible runs
+    explicit Chip8(unsigned int seed) : memory(BootImage()), randGen(seed)
     {
       // Initialize PC
       pc = START_ADDRESS;
 
-      // Load fonts into memory
-      for (unsigned int i = 0; i < FONTSET_SIZE; ++i)
-      {
-        memory[FONTSET_START_ADDRESS + i] = fontset[i];
-      }
-
       // Initialize RNG
       randByte = std::uniform_int_distribution<uint8_t>(0, 255U);
 
-      //Function Pointer Table
-      void (Chip8::*table[16]) ();
-      void (Chip8::*table0[16]) ();
-      void (Chip8::*table8[16]) ();
-      void (Chip8::*tableE[16]) ();
-      void (Chip8::*tableF[256]) ();
+      //Function Pointer Table, shared by all instances and built once
+      static bool tablesBuilt = BuildTables();
+      (void)tablesBuilt;
+    }
+
+    //Memory contents of a freshly reset machine, built on first use
+    static uint8_t const* BootImage() {
+      static uint8_t image[MEMORY_SIZE] = {};
+      static bool built = [] {
+        // Load fonts into memory
+        for (unsigned int i = 0; i < FONTSET_SIZE; ++i)
+        {
+          image[FONTSET_START_ADDRESS + i] = fontset[i];
+        }
+        return true;
+      }();
+      (void)built;
+      return image;
+    }
+
+    static bool BuildTables() {
+      for (Chip8Func& func : table) func = &Chip8::OP_NULL;
+      for (Chip8Func& func : table0) func = &Chip8::OP_0nnn;
+      for (Chip8Func& func : table8) func = &Chip8::OP_NULL;
+      for (Chip8Func& func : tableE) func = &Chip8::OP_NULL;
+      for (Chip8Func& func : tableF) func = &Chip8::OP_NULL;
 
       table[0x0] = &Chip8::Table0;
       table[0x1] = &Chip8::OP_1nnn;
@@ -304,7 +918,7 @@ class Chip8 {
       tableF[0x33] = &Chip8::OP_Fx33;
       tableF[0x55] = &Chip8::OP_Fx55;
       tableF[0x65] = &Chip8::OP_Fx65;
-      
+      return true;
     }
 
     void Table0() {
@@ -326,44 +940,241 @@ class Chip8 {
     void OP_NULL() {
     }
 
+    //0nnn: SYS addr. Machine code cannot run here; host calls go to the attached handler
+    void OP_0nnn() {
+      if (hostCalls && IsHostCall(opcode)) {
+        hostCalls->OnHostCall(*this, static_cast<HostCall>(opcode & 0x000Fu), (opcode & 0x00F0u) >> 4u);
+      }
+    }
+
+    //Loads a ROM image already in memory
+    void LoadROM(uint8_t const* data, size_t size) {
+      size = std::min<size_t>(size, MEMORY_SIZE - START_ADDRESS);
+      memory.Write(START_ADDRESS, data, size);
+      memory.Intern();
+      romHash = Fnv1a(FNV_OFFSET_BASIS, data, size);
+    }
+
     void LoadROM(char const* filename) {
       // Open the file as a stream of binary and move the file pointer to the end
       std::ifstream file(filename, std::ios::binary | std::ios::ate);
 
       if (file.is_open())
       {
-        // Get size of file and allocate a buffer to hold the contents
-        std::streampos size = file.tellg();
-        char* buffer = new char[size];
+        // Get size of file, clamped to the memory above 0x200
+        std::streamoff size = std::min<std::streamoff>(file.tellg(), MEMORY_SIZE - START_ADDRESS);
 
-        // Go back to the beginning of the file and fill the buffer
+        // Go back to the beginning of the file, read it and place it in memory at 0x200
+        std::vector<char> rom(static_cast<size_t>(size));
         file.seekg(0, std::ios::beg);
-        file.read(buffer, size);
-        file.close();
+        file.read(rom.data(), size);
+        LoadROM(reinterpret_cast<uint8_t const*>(rom.data()), static_cast<size_t>(file.gcount()));
+      }
+    }
 
-        // Load the ROM contents into the Chip8's memory, starting at 0x200
-        for (long i = 0; i < size; ++i)
-        {
-          memory[START_ADDRESS + i] = buffer[i];
-        }
+    //Copies the machine state out; false if the RNG state does not fit
+    bool SaveState(Chip8State& state) const {
+      memcpy(state.registers, registers, sizeof(registers));
+      memory.Read(0, state.memory, MEMORY_SIZE);
+      state.index = index;
+      state.pc = pc;
+      memcpy(state.stack, stack, sizeof(stack));
+      state.sp = sp;
+      state.delayTimer = delayTimer;
+      state.soundTimer = soundTimer;
+      memcpy(state.keypad, keypad, sizeof(keypad));
+      memcpy(state.video, video, sizeof(video));
+      state.cycleCarry = cycleCarry;
+
+      std::ostringstream rng;
+      rng << randGen;
+      std::string text = rng.str();
+      memset(state.rng, 0, sizeof(state.rng));
+      if (text.size() >= sizeof(state.rng)) {
+        return false;
+      }
+      memcpy(state.rng, text.data(), text.size());
+      return true;
+    }
+
+    void LoadState(Chip8State const& state) {
+      memcpy(registers, state.registers, sizeof(registers));
+      memory.Write(0, state.memory, MEMORY_SIZE);
+      memory.Intern();
+      index = state.index;
+      pc = state.pc;
+      memcpy(stack, state.stack, sizeof(stack));
+      sp = state.sp;
+      delayTimer = state.delayTimer;
+      soundTimer = state.soundTimer;
+      memcpy(keypad, state.keypad, sizeof(keypad));
+      memcpy(video, state.video, sizeof(video));
+      cycleCarry = state.cycleCarry;
+
+      std::istringstream rng(std::string(state.rng, strnlen(state.rng, sizeof(state.rng))));
+      rng >> randGen;
+    }
 
-        // Free the buffer
-        delete[] buffer;
+    /**
+     * True when further cycles cannot change the machine until input
+     * changes: the next instruction is a jump to itself or an Fx0A key
+     * wait with no key down, and both timers have run out.
+     */
+    bool IsIdle() const {
+      if (delayTimer || soundTimer || pc >= MEMORY_SIZE - 1) {
+        return false;
+      }
+      uint16_t next = memory.Word(pc & ADDRESS_MASK);
+      if (next == (0x1000u | pc)) {
+        return true;
       }
+      if ((next & 0xF0FFu) == 0xF00Au) {
+        for (uint8_t key : keypad) {
+          if (key) return false;
+        }
+        return true;
+      }
+      return false;
     }
 
     //Main function
     void Cycle() {
       //Fetch: opcode is 64 bits long, so retrieve from 2 memory locations
-      opcode = (memory[pc] << 8u) | memory[pc + 1];  
+      opcode = memory.Word(pc & ADDRESS_MASK);
+      HEATMAP_COUNT(executes, pc);
+      HEATMAP_COUNT(executes, pc + 1);
 
       //Increment pc
       pc += 2;
       
       //Decode and execute
       ((*this).*(table[(opcode & 0xF000u) >> 12u]))();
+    }
+
+    //Same as Cycle(), dispatching through a switch instead of the function tables
+    void CycleSwitch() {
+      opcode = memory.Word(pc & ADDRESS_MASK);
+      HEATMAP_COUNT(executes, pc);
+      HEATMAP_COUNT(executes, pc + 1);
+      pc += 2;
+
+      switch (opcode >> 12u) {
+        case 0x0: Table0(); break;
+        case 0x1: OP_1nnn(); break;
+        case 0x2: OP_2nnn(); break;
+        case 0x3: OP_3xkk(); break;
+        case 0x4: OP_4xkk(); break;
+        case 0x5: OP_5xy0(); break;
+        case 0x6: OP_6xkk(); break;
+        case 0x7: OP_7xkk(); break;
+        case 0x8:
+          switch (opcode & 0x000Fu) {
+            case 0x0: OP_8xy0(); break;
+            case 0x1: OP_8xy1(); break;
+            case 0x2: OP_8xy2(); break;
+            case 0x3: OP_8xy3(); break;
+            case 0x4: OP_8xy4(); break;
+            case 0x5: OP_8xy5(); break;
+            case 0x6: OP_8xy6(); break;
+            case 0x7: OP_8xy7(); break;
+            case 0xE: OP_8xyE(); break;
+            default: Table8(); break;
+          }
+          break;
+        case 0x9: OP_9xy0(); break;
+        case 0xA: OP_Annn(); break;
+        case 0xB: OP_Bnnn(); break;
+        case 0xC: OP_Cxkk(); break;
+        case 0xD: OP_Dxyn(); break;
+        case 0xE: TableE(); break;
+        default:
+          switch (opcode & 0x00FFu) {
+            case 0x07: OP_Fx07(); break;
+            case 0x0A: OP_Fx0A(); break;
+            case 0x15: OP_Fx15(); break;
+            case 0x18: OP_Fx18(); break;
+            case 0x1E: OP_Fx1E(); break;
+            case 0x29: OP_Fx29(); break;
+            case 0x33: OP_Fx33(); break;
+            case 0x55: OP_Fx55(); break;
+            case 0x65: OP_Fx65(); break;
+            default: TableF(); break;
+          }
+          break;
+      }
+    }
+
+    //Runs one 60 Hz frame: the given number of instructions, then a timer tick
+    void RunFrame(unsigned int instructions) {
+      for (unsigned int i = 0; i < instructions; ++i) {
+        Cycle();
+      }
+      TickTimers();
+    }
+
+    /**
+     * Machine cycles the COSMAC VIP interpreter spends on an instruction,
+     * from published analyses of the VIP interpreter. Costs that depend
+     * on whether a skip is taken are averaged; Dxyn depends on its height
+     * and on whether the sprite straddles a byte boundary, because the
+     * VIP has to shift every row.
+     */
+    unsigned int VipCost(uint16_t op) const {
+      static const uint8_t familyCost[16] = {
+        10, 12, 26, 12, 12, 16, 6, 10, 44, 16, 12, 22, 36, 26, 16, 0
+      };
+      unsigned int cost = VIP_FETCH_CYCLES + familyCost[op >> 12u];
+      switch (op >> 12u) {
+        case 0x0:
+          return op == 0x00E0u ? cost + 3078 : cost;
+
+        case 0xD: {
+          unsigned int rows = op & 0x000Fu;
+          bool straddles = registers[(op & 0x0F00u) >> 8u] & 0x7u;
+          return cost + rows * (straddles ? 68 : 44);
+        }
+
+        case 0xF:
+          switch (op & 0x00FFu) {
+            case 0x07: case 0x15: case 0x18: return cost + 10;
+            case 0x0A: return cost + 19;
+            case 0x1E: case 0x29: return cost + 16;
+            case 0x33: return cost + 84 + 3 * 32;
+            case 0x55: case 0x65: return cost + 14 + 14 * (((op & 0x0F00u) >> 8u) + 1);
+            default: return cost;
+          }
+
+        default:
+          return cost;
+      }
+    }
 
-      //Decrement sound and delay timer if set
+    /**
+     * Runs one 60 Hz frame at COSMAC VIP speed: instructions are charged
+     * their VipCost() until the frame's machine-cycle budget is spent.
+     * An overrun is carried into the next frame so the long-run rate is
+     * exact. With displayWait, Dxyn waits for the next vertical blank as
+     * on the VIP, which ends the frame. Returns instructions executed.
+     */
+    unsigned int RunVipFrame(bool displayWait = true) {
+      int32_t budget = static_cast<int32_t>(VIP_CYCLES_PER_FRAME - VIP_DISPLAY_CYCLES) + cycleCarry;
+      unsigned int instructions = 0;
+      while (budget > 0) {
+        uint16_t next = memory.Word(pc & ADDRESS_MASK);
+        budget -= static_cast<int32_t>(VipCost(next));
+        Cycle();
+        ++instructions;
+        if (displayWait && (next & 0xF000u) == 0xD000u) {
+          budget = 0;
+        }
+      }
+      cycleCarry = budget;
+      TickTimers();
+      return instructions;
+    }
+
+    //Decrement sound and delay timer if set. Called at TIMER_HZ by the run loop.
+    void TickTimers() {
       if (delayTimer > 0) {
         --delayTimer;
       }
@@ -378,7 +1189,7 @@ class Chip8 {
      * Clears the display.
      */
     void OP_00E0() {
-      memset(video, 0, VIDEO_HEIGHT * VIDEO_WIDTH);
+      memset(video, 0, sizeof(video));
     }
     
     /**
@@ -387,7 +1198,7 @@ class Chip8 {
      */
     void OP_00EE() {
       --sp;
-      pc = stack[sp];
+      pc = stack[sp & 0xFu];
     }
 
     /**
@@ -405,8 +1216,7 @@ class Chip8 {
      */
     void OP_2nnn() {
       uint16_t address = opcode & 0x0FFFu;
-      pc = address;
-      stack[sp] = pc;
+      stack[sp & 0xFu] = pc;
       ++sp;
       pc = address;
     }
@@ -643,27 +1453,33 @@ class Chip8 {
       uint8_t xPos = registers[Vx] % VIDEO_WIDTH;
       uint8_t yPos = registers[Vy] % VIDEO_HEIGHT;
 
-      registers[15] = 0;
-
-      for (unsigned int row = 0; row < height; row++) {
-        uint8_t spriteByte = memory[index + row];
+      uint8_t collision = 0;
 
-        for (unsigned int col = 0; col < 8; col++) {
-          uint8_t spritePixel = spriteByte & (0x80u >> col);
-          uint32_t* screenPixel = &video[(yPos + row) * VIDEO_WIDTH];
+      //Masked once per draw; only a sprite straddling a page is gathered byte by byte
+      uint8_t gathered[15];
+      uint8_t const* sprite = memory.ReadSpan(index & ADDRESS_MASK, height);
+      if (!sprite) {
+        for (unsigned int row = 0; row < height; row++) {
+          gathered[row] = memory[(index + row) & ADDRESS_MASK];
+        }
+        sprite = gathered;
+      }
 
-          if (spritePixel) { //Sprite pixel is set
-            if (*screenPixel == 0xFFFFFFFF) { //Screen pixel also set - collision
-              registers[15] = 1;
-            }
-            
-          } 
+      //Sprites wrap around both edges of the screen
+      for (unsigned int row = 0; row < height; row++) {
+        uint8_t spriteByte = sprite[row];
+        HEATMAP_COUNT(reads, index + row);
+        uint32_t* screenRow = &video[((yPos + row) & (VIDEO_HEIGHT - 1)) * VIDEO_WIDTH];
 
-          //XOR with sprite pixel since it is now set
+        //Visit only the set sprite pixels, lowest bit (rightmost column) first
+        for (unsigned int bits = spriteByte; bits; bits &= bits - 1) {
+          unsigned int col = 7u - static_cast<unsigned int>(std::countr_zero(bits));
+          uint32_t* screenPixel = &screenRow[(xPos + col) & (VIDEO_WIDTH - 1)];
+          collision |= *screenPixel == 0xFFFFFFFF; //Screen pixel also set
           *screenPixel ^= 0xFFFFFFFF;
-
         }
       }
+      registers[15] = collision;
     }
 
      /**
@@ -672,7 +1488,7 @@ class Chip8 {
      */
     void OP_Ex9E() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t key = registers[Vx];
+      uint8_t key = registers[Vx] & 0xFu;
       if (keypad[key]) {
         pc += 2;
       }
@@ -684,7 +1500,7 @@ class Chip8 {
      */
     void OP_ExA1() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t key = registers[Vx];
+      uint8_t key = registers[Vx] & 0xFu;
       if (!keypad[key]) {
         pc += 2;
       }
@@ -777,7 +1593,7 @@ class Chip8 {
     void OP_Fx29() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
       uint8_t digit = registers[Vx];
-      index += FONTSET_START_ADDRESS + (5 * digit);
+      index = FONTSET_START_ADDRESS + (5 * digit);
     }
 
     /**
@@ -791,12 +1607,20 @@ class Chip8 {
     void OP_Fx33() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
       uint8_t value = registers[Vx];
-      
-      memory[index+2] = value % 10;
-      value /= 10;
-      memory[index+1] = value % 10;
-      value /= 10;
-      memory[index] = value % 10;
+      uint8_t digits[3] = {static_cast<uint8_t>(value / 100), static_cast<uint8_t>(value / 10 % 10), static_cast<uint8_t>(value % 10)};
+
+      if (uint8_t* bytes = memory.WriteSpan(index & ADDRESS_MASK, 3)) {
+        bytes[0] = digits[0];
+        bytes[1] = digits[1];
+        bytes[2] = digits[2];
+      } else {
+        for (unsigned int i = 0; i < 3; i++) {
+          memory.Write((index + i) & ADDRESS_MASK, digits[i]);
+        }
+      }
+      HEATMAP_COUNT(writes, index);
+      HEATMAP_COUNT(writes, index + 1);
+      HEATMAP_COUNT(writes, index + 2);
     }
 
     /**
@@ -806,9 +1630,18 @@ class Chip8 {
      */
     void OP_Fx55() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      unsigned int start = index & ADDRESS_MASK;
+      if (uint8_t* bytes = memory.WriteSpan(start, Vx + 1u)) {
+        for (int reg = 0; reg <= Vx; reg++) {
+          bytes[reg] = registers[reg];
+        }
+      } else {
+        for (int reg = 0; reg <= Vx; reg++) {
+          memory.Write((index + reg) & ADDRESS_MASK, registers[reg]);
+        }
+      }
       for (int reg = 0; reg <= Vx; reg++) {
-          uint8_t value = registers[reg];
-          memory[index + reg] = value;
+          HEATMAP_COUNT(writes, index + reg);
       }
     }
 
@@ -819,16 +1652,6199 @@ class Chip8 {
      */
     void OP_Fx65() {
       uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      unsigned int start = index & ADDRESS_MASK;
+      if (uint8_t const* bytes = memory.ReadSpan(start, Vx + 1u)) {
+        for (int reg = 0; reg <= Vx; reg++) {
+          registers[reg] = bytes[reg];
+        }
+      } else {
+        for (int reg = 0; reg <= Vx; reg++) {
+          registers[reg] = memory[(index + reg) & ADDRESS_MASK];
+        }
+      }
       for (int reg = 0; reg <= Vx; reg++) {
-          registers[reg] = memory[index + reg];
+          HEATMAP_COUNT(reads, index + reg);
       }
     }
 
     typedef void (Chip8::*Chip8Func)();
-    Chip8Func table[0xF + 1]{&Chip8::OP_NULL};
-    Chip8Func table0[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func table8[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func tableE[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func tableF[0x65 + 1]{&Chip8::OP_NULL};
+    static inline Chip8Func table[0xF + 1];
+    static inline Chip8Func table0[0xF + 1];
+    static inline Chip8Func table8[0xF + 1];
+    static inline Chip8Func tableE[0xF + 1];
+    static inline Chip8Func tableF[0xFF + 1];
     
 };
+
+/**
+ * Hooks into the interactive run loop, around input and presentation.
+ */
+class FrameObserver {
+  public:
+    virtual ~FrameObserver() {}
+
+    //Called before the frontend's input is processed for the next frame
+    virtual void BeforeInput() {}
+
+    //Called once the frame has been presented, with the clock time of the present
+    virtual void AfterPresent(Chip8 const&, Clock::Duration) {}
+};
+
+const char* const STARTUP_FIRST_CYCLE = "first_cycle";
+const char* const STARTUP_FIRST_PRESENT = "first_present";
+const Clock::Duration STARTUP_TARGET_HEADLESS = std::chrono::milliseconds(1);
+const Clock::Duration STARTUP_TARGET_WINDOWED = std::chrono::milliseconds(50);
+
+/**
+ * Startup phase timer. Create it first thing in main(); the run loop
+ * marks the first Cycle() and the first present, and callers can mark
+ * their own phases (ROM loaded, etc.) in between.
+ */
+class StartupProfile {
+  public:
+    explicit StartupProfile(Clock& clock) : clock(clock), start(clock.Now()) {}
+
+    //Records when a phase was first reached; later marks are ignored
+    void Mark(char const* phase) {
+      if (Elapsed(phase) < Clock::Duration::zero()) {
+        phases.emplace_back(phase, clock.Now() - start);
+      }
+    }
+
+    //Time from creation to the phase, or a negative duration if not reached
+    Clock::Duration Elapsed(char const* phase) const {
+      for (auto const& entry : phases) {
+        if (entry.first == phase) return entry.second;
+      }
+      return Clock::Duration(-1);
+    }
+
+    //Whether the last startup milestone came in under the target
+    bool MeetsTarget(bool windowed) const {
+      Clock::Duration reached = Elapsed(windowed ? STARTUP_FIRST_PRESENT : STARTUP_FIRST_CYCLE);
+      return reached >= Clock::Duration::zero() && reached <= (windowed ? STARTUP_TARGET_WINDOWED : STARTUP_TARGET_HEADLESS);
+    }
+
+    void Print(FILE* out) const {
+      for (auto const& entry : phases) {
+        fprintf(out, "startup %-16s %9.3f ms\n", entry.first.c_str(), std::chrono::duration<double, std::milli>(entry.second).count());
+      }
+    }
+
+  private:
+    Clock& clock;
+    Clock::Duration start;
+    std::vector<std::pair<std::string, Clock::Duration>> phases;
+};
+
+/**
+ * Per-ROM settings, keyed by the FNV-1a hash of the ROM image so a game
+ * is recognised under any filename. Stored as text, one ROM per line:
+ * hash (hex), cycles per frame, then the name to the end of the line.
+ */
+class RomIndex {
+  public:
+    struct Entry {
+      unsigned int cyclesPerFrame;
+      std::string name;
+    };
+
+    static uint64_t RomHash(uint8_t const* rom, size_t size) {
+      return Fnv1a(FNV_OFFSET_BASIS, rom, size);
+    }
+
+    bool Load(char const* filename) {
+      std::ifstream file(filename);
+      if (!file.is_open()) {
+        return false;
+      }
+      //One line at a time, so a malformed line cannot swallow the next
+      std::string line;
+      while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        uint64_t hash;
+        Entry entry;
+        if (fields >> std::hex >> hash >> std::dec >> entry.cyclesPerFrame && std::getline(fields >> std::ws, entry.name) && !entry.name.empty()) {
+          entries[hash] = entry;
+        }
+      }
+      return true;
+    }
+
+    bool Save(char const* filename) const {
+      std::ofstream file(filename, std::ios::trunc);
+      for (auto const& entry : entries) {
+        file << std::hex << entry.first << std::dec << ' ' << entry.second.cyclesPerFrame << ' ' << entry.second.name << '\n';
+      }
+      return file.good();
+    }
+
+    //False for a name the text format cannot hold: empty, or spanning lines
+    bool Set(uint64_t romHash, unsigned int cyclesPerFrame, std::string const& name) {
+      if (name.empty() || name.find_first_of("\r\n") != std::string::npos) {
+        return false;
+      }
+      entries[romHash] = Entry{cyclesPerFrame, name};
+      return true;
+    }
+
+    Entry const* Find(uint64_t romHash) const {
+      auto it = entries.find(romHash);
+      return it != entries.end() ? &it->second : nullptr;
+    }
+
+    //The budget recorded for this ROM, or fallback if it has none
+    unsigned int CyclesPerFrame(uint8_t const* rom, size_t size, unsigned int fallback) const {
+      return CyclesPerFrame(RomHash(rom, size), fallback);
+    }
+
+    //Same, for the ROM a Chip8 has loaded (see Chip8::romHash)
+    unsigned int CyclesPerFrame(uint64_t romHash, unsigned int fallback) const {
+      Entry const* entry = Find(romHash);
+      return entry && entry->cyclesPerFrame ? entry->cyclesPerFrame : fallback;
+    }
+
+    size_t Size() const {
+      return entries.size();
+    }
+
+  private:
+    std::map<uint64_t, Entry> entries;
+};
+
+/**
+ * Run loop: executes cyclesPerFrame instructions (or, with VIP timing,
+ * one frame's worth of VIP machine cycles) and one timer tick per
+ * 60 Hz frame, paced against an injected Clock.
+ */
+class Runner {
+  public:
+    Runner(Chip8& chip8, Clock& clock, unsigned int cyclesPerFrame)
+      : chip8(chip8), clock(clock), cyclesPerFrame(cyclesPerFrame), vipTiming(false), frameCount(0), soundTime(0),
+        startup(nullptr), observer(nullptr) {}
+
+    //Runs the loaded ROM at the budget the index records for it, or fallback
+    Runner(Chip8& chip8, Clock& clock, RomIndex const& roms, unsigned int fallback)
+      : Runner(chip8, clock, roms.CyclesPerFrame(chip8.romHash, fallback)) {}
+
+    void SetObserver(FrameObserver* frameObserver) {
+      observer = frameObserver;
+    }
+
+    //Marks the first cycle and first present on the profile
+    void SetStartupProfile(StartupProfile* profile) {
+      startup = profile;
+    }
+
+    //Switches to the COSMAC VIP cycle-cost model instead of a fixed instruction count
+    void SetVipTiming(bool enabled) {
+      vipTiming = enabled;
+    }
+
+    //Emulates one frame without any pacing
+    void RunFrame() {
+      if (startup && frameCount == 0) {
+        startup->Mark(STARTUP_FIRST_CYCLE);
+      }
+      if (chip8.soundTimer > 0) {
+        soundTime += FrameDeadline(frameCount + 1) - FrameDeadline(frameCount);
+      }
+      if (vipTiming) {
+        chip8.RunVipFrame();
+      } else {
+        chip8.RunFrame(cyclesPerFrame);
+      }
+      ++frameCount;
+    }
+
+    //Runs headless for the given amount of clock time
+    void RunFor(Clock::Duration duration) {
+      Clock::Duration start = clock.Now();
+      uint64_t firstFrame = frameCount;
+      while (FrameDeadline(frameCount - firstFrame) < duration) {
+        RunFrame();
+        clock.SleepUntil(start + FrameDeadline(frameCount - firstFrame));
+      }
+    }
+
+    //Runs with a frontend until it asks to quit
+    void Run(Platform& platform, int videoPitch) {
+      Clock::Duration start = clock.Now();
+      uint64_t firstFrame = frameCount;
+      for (;;) {
+        if (observer) {
+          observer->BeforeInput();
+        }
+        if (platform.ProcessInput(chip8.keypad)) {
+          break;
+        }
+        RunFrame();
+        platform.Update(chip8.video, videoPitch);
+        if (startup) {
+          startup->Mark(STARTUP_FIRST_PRESENT);
+          startup = nullptr;
+        }
+        if (observer) {
+          observer->AfterPresent(chip8, platform.LastPresent());
+        }
+        clock.SleepUntil(start + FrameDeadline(frameCount - firstFrame));
+      }
+    }
+
+    uint64_t FrameCount() const {
+      return frameCount;
+    }
+
+    //Total clock time during which the sound timer was active (buzzer on)
+    Clock::Duration SoundTime() const {
+      return soundTime;
+    }
+
+  private:
+    //Offset of the start of a frame, computed from the frame number so it never drifts
+    static Clock::Duration FrameDeadline(uint64_t frame) {
+      return Clock::Duration(static_cast<Clock::Duration::rep>(frame * 1000000000ull / TIMER_HZ));
+    }
+
+    Chip8& chip8;
+    Clock& clock;
+    unsigned int cyclesPerFrame;
+    bool vipTiming;
+    uint64_t frameCount;
+    Clock::Duration soundTime;
+    StartupProfile* startup;
+    FrameObserver* observer;
+};
+
+/**
+ * Measures input-to-present latency. Once the picture has been stable
+ * for a few frames it pushes a synthetic key press into SDL's event
+ * queue, timestamped on the clock, and waits for the first presented
+ * frame whose hash differs; the time from injection to that present is
+ * one sample. The key is then released and the cycle repeats. Samples
+ * are labelled with the frontend configuration under test (vsync,
+ * render thread, run-ahead, ...).
+ */
+class LatencyProbe : public FrameObserver {
+  public:
+    LatencyProbe(Clock& clock, std::string const& config, uint8_t key, unsigned int settleFrames = 4, unsigned int timeoutFrames = 120)
+      : clock(clock), config(config), key(key), settleFrames(settleFrames), timeoutFrames(timeoutFrames),
+        state(SETTLING), frames(0), lastHash(0), injectedAt(0), timeouts(0) {}
+
+    void BeforeInput() override {
+      if (state == PRESS) {
+        PushKey(SDL_KEYDOWN);
+        injectedAt = clock.Now();
+        state = WAITING;
+        frames = 0;
+      } else if (state == RELEASE) {
+        PushKey(SDL_KEYUP);
+        state = SETTLING;
+        frames = 0;
+      }
+    }
+
+    void AfterPresent(Chip8 const& chip8, Clock::Duration presented) override {
+      uint64_t hash = FrameHash(chip8.video);
+      bool changed = hash != lastHash;
+      lastHash = hash;
+
+      if (state == SETTLING) {
+        frames = changed ? 0 : frames + 1;
+        if (frames >= settleFrames) {
+          state = PRESS;
+        }
+      } else if (state == WAITING) {
+        if (changed) {
+          samples.push_back(presented - injectedAt);
+          state = RELEASE;
+        } else if (++frames >= timeoutFrames) {
+          ++timeouts;
+          state = RELEASE;
+        }
+      }
+    }
+
+    //Latency at a percentile in [0, 100], or zero without samples
+    Clock::Duration Percentile(double percentile) const {
+      if (samples.empty()) {
+        return Clock::Duration::zero();
+      }
+      std::vector<Clock::Duration> sorted(samples);
+      std::sort(sorted.begin(), sorted.end());
+      size_t rank = static_cast<size_t>(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+      return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    size_t SampleCount() const {
+      return samples.size();
+    }
+
+    //Presses that never changed the picture within the timeout
+    size_t Timeouts() const {
+      return timeouts;
+    }
+
+    void Print(FILE* out) const {
+      auto ms = [](Clock::Duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+      fprintf(out, "latency %-24s n=%zu timeouts=%zu p50=%.2fms p90=%.2fms p99=%.2fms max=%.2fms\n",
+              config.c_str(), samples.size(), timeouts, ms(Percentile(50)), ms(Percentile(90)), ms(Percentile(99)), ms(Percentile(100)));
+    }
+
+  private:
+    enum State { SETTLING, PRESS, WAITING, RELEASE };
+
+    void PushKey(Uint32 type) {
+      SDL_Event event = {};
+      event.type = type;
+      event.key.state = type == SDL_KEYDOWN ? SDL_PRESSED : SDL_RELEASED;
+      event.key.keysym.sym = KEYMAP[key & 0xFu];
+      SDL_PushEvent(&event);
+    }
+
+    Clock& clock;
+    std::string config;
+    uint8_t key;
+    unsigned int settleFrames;
+    unsigned int timeoutFrames;
+    State state;
+    unsigned int frames;
+    uint64_t lastHash;
+    Clock::Duration injectedAt;
+    size_t timeouts;
+    std::vector<Clock::Duration> samples;
+};
+
+/**
+ * Packs a video buffer to 1 bit per pixel, MSB first, row by row
+ * (PACKED_FRAME_SIZE bytes).
+ */
+void PackFrame(uint32_t const* video, uint8_t* packed) {
+  for (unsigned int i = 0; i < PACKED_FRAME_SIZE; ++i) {
+    uint8_t byte = 0;
+    for (unsigned int bit = 0; bit < 8; ++bit) {
+      byte = (byte << 1u) | (video[i * 8 + bit] ? 1u : 0u);
+    }
+    packed[i] = byte;
+  }
+}
+
+//Keypad state as a bitmask, bit n set when key n is down
+uint16_t KeypadMask(uint8_t const* keypad) {
+  uint16_t mask = 0;
+  for (unsigned int key = 0; key < 16; ++key) {
+    mask |= (keypad[key] ? 1u : 0u) << key;
+  }
+  return mask;
+}
+
+void ApplyKeypadMask(uint16_t mask, uint8_t* keypad) {
+  for (unsigned int key = 0; key < 16; ++key) {
+    keypad[key] = (mask >> key) & 1u;
+  }
+}
+
+/**
+ * Frame dataset file layout (all integers little-endian):
+ *
+ *   DatasetHeader
+ *   chunk data: per chunk, the frames, keys and (optional) RAM columns
+ *   DatasetChunk[chunkCount]  (the index)
+ *   DatasetFooter
+ *
+ * Each column of each chunk is stored with whichever codec came out
+ * smallest. Raw columns can be read straight out of the mapping.
+ */
+const uint32_t DATASET_MAGIC = 0x53443843; // "C8DS"
+const uint32_t DATASET_INDEX_MAGIC = 0x49443843; // "C8DI"
+const uint16_t DATASET_VERSION = 1;
+const uint16_t DATASET_HAS_RAM = 0x1;
+const unsigned int DATASET_COLUMNS = 3;
+const unsigned int KEYS_RECORD_SIZE = 2;
+const unsigned int RAM_RECORD_SIZE = 4096;
+
+enum DatasetCodec : uint8_t {
+  CODEC_RAW = 0,
+  CODEC_RLE = 1,
+  CODEC_XOR_RLE = 2 // each record XORed with the previous one, then RLE
+};
+
+struct DatasetHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  uint32_t chunkFrames;
+  uint32_t reserved;
+};
+
+struct DatasetColumn {
+  uint64_t offset;
+  uint32_t size;
+  uint8_t codec;
+  uint8_t padding[3];
+};
+
+struct DatasetChunk {
+  uint64_t firstFrame;
+  uint32_t frameCount;
+  uint32_t reserved;
+  DatasetColumn columns[DATASET_COLUMNS]; // frames, keys, RAM
+};
+
+struct DatasetFooter {
+  uint64_t indexOffset;
+  uint32_t chunkCount;
+  uint32_t magic;
+};
+
+/**
+ * Byte RLE. A control byte c < 128 is followed by c + 1 literal bytes,
+ * c >= 128 by one byte repeated c - 126 times (2 to 129).
+ */
+void RleEncode(uint8_t const* data, size_t size, std::vector<uint8_t>& out) {
+  size_t i = 0;
+  while (i < size) {
+    size_t run = 1;
+    while (i + run < size && run < 129 && data[i + run] == data[i]) {
+      ++run;
+    }
+    if (run >= 2) {
+      out.push_back(static_cast<uint8_t>(run + 126));
+      out.push_back(data[i]);
+      i += run;
+      continue;
+    }
+
+    size_t start = i;
+    while (i < size && i - start < 128 && (i + 1 >= size || data[i + 1] != data[i])) {
+      ++i;
+    }
+    if (i == start) {
+      ++i;
+    }
+    out.push_back(static_cast<uint8_t>(i - start - 1));
+    out.insert(out.end(), data + start, data + i);
+  }
+}
+
+//Returns false if the input is malformed or does not decode to exactly size bytes
+bool RleDecode(uint8_t const* data, size_t size, uint8_t* out, size_t outSize) {
+  size_t o = 0;
+  size_t i = 0;
+  while (i < size) {
+    uint8_t control = data[i++];
+    if (control < 128) {
+      size_t count = control + 1u;
+      if (i + count > size || o + count > outSize) return false;
+      memcpy(out + o, data + i, count);
+      i += count;
+      o += count;
+    } else {
+      size_t count = control - 126u;
+      if (i >= size || o + count > outSize) return false;
+      memset(out + o, data[i++], count);
+      o += count;
+    }
+  }
+  return o == outSize;
+}
+
+/**
+ * Encodes one column with the smallest of the three codecs.
+ */
+DatasetCodec EncodeColumn(std::vector<uint8_t> const& column, size_t recordSize, std::vector<uint8_t>& out, std::vector<uint8_t>& scratch) {
+  std::vector<uint8_t> rle;
+  RleEncode(column.data(), column.size(), rle);
+
+  scratch.resize(column.size());
+  for (size_t i = 0; i < column.size(); ++i) {
+    scratch[i] = i < recordSize ? column[i] : column[i] ^ column[i - recordSize];
+  }
+  std::vector<uint8_t> xorRle;
+  RleEncode(scratch.data(), scratch.size(), xorRle);
+
+  if (xorRle.size() < rle.size() && xorRle.size() < column.size()) {
+    out.swap(xorRle);
+    return CODEC_XOR_RLE;
+  }
+  if (rle.size() < column.size()) {
+    out.swap(rle);
+    return CODEC_RLE;
+  }
+  out = column;
+  return CODEC_RAW;
+}
+
+/**
+ * Writes a frame dataset. Append() only packs the frame into the open
+ * chunk; full chunks are compressed and written by a background thread
+ * so the emulation that feeds it does not wait on the disk. At most
+ * maxQueued full chunks wait for that thread; past that Append()
+ * blocks until one is written, so a slow disk throttles the producer
+ * instead of growing memory without bound.
+ */
+class DatasetWriter {
+  public:
+    DatasetWriter(bool withRam, uint32_t chunkFrames = 1024, size_t maxQueued = 4)
+      : withRam(withRam), chunkFrames(chunkFrames ? chunkFrames : 1), maxQueued(maxQueued ? maxQueued : 1),
+        frameCount(0), closed(true), failed(false), done(false) {}
+
+    ~DatasetWriter() {
+      Close();
+    }
+
+    //False if the file cannot be created or is already open; Append() then drops every frame
+    bool Open(char const* filename) {
+      if (!closed) {
+        return false;
+      }
+      file.open(filename, std::ios::binary | std::ios::trunc);
+      DatasetHeader header = {DATASET_MAGIC, DATASET_VERSION, static_cast<uint16_t>(withRam ? DATASET_HAS_RAM : 0), chunkFrames, 0};
+      file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+      if (!file.good()) {
+        file.close();
+        file.clear();
+        failed = true;
+        return false;
+      }
+      closed = false;
+      failed = false;
+      done = false;
+      frameCount = 0;
+      index.clear();
+      current = NewChunk();
+      writer = std::thread(&DatasetWriter::WriterLoop, this);
+      return true;
+    }
+
+    bool IsOpen() const {
+      return !closed;
+    }
+
+    /**
+     * Records one frame; memory may be null when the dataset has no RAM
+     * column. False, dropping the frame, if the writer is not open or
+     * an earlier write failed.
+     */
+    bool Append(uint32_t const* video, uint8_t const* keypad, GuestMemory const* memory) {
+      if (closed || failed) {
+        return false;
+      }
+      PendingChunk& chunk = *current;
+      size_t n = chunk.frameCount++;
+      PackFrame(video, &chunk.frames[n * PACKED_FRAME_SIZE]);
+      uint16_t keys = KeypadMask(keypad);
+      chunk.keys[n * KEYS_RECORD_SIZE] = keys & 0xFFu;
+      chunk.keys[n * KEYS_RECORD_SIZE + 1] = keys >> 8u;
+      if (withRam) {
+        memory->Read(0, &chunk.ram[n * RAM_RECORD_SIZE], RAM_RECORD_SIZE);
+      }
+      ++frameCount;
+
+      if (chunk.frameCount == chunkFrames) {
+        Submit();
+      }
+      return true;
+    }
+
+    //Flushes the open chunk, waits for the writer and finishes the index; false if any of it failed to reach the file
+    bool Close() {
+      if (closed) {
+        return !failed;
+      }
+      closed = true;
+      if (current->frameCount > 0) {
+        Submit();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+      }
+      wake.notify_one();
+      writer.join();
+
+      DatasetFooter footer;
+      footer.indexOffset = static_cast<uint64_t>(file.tellp());
+      footer.chunkCount = static_cast<uint32_t>(index.size());
+      footer.magic = DATASET_INDEX_MAGIC;
+      file.write(reinterpret_cast<char const*>(index.data()), index.size() * sizeof(DatasetChunk));
+      file.write(reinterpret_cast<char const*>(&footer), sizeof(footer));
+      file.close();
+      if (!file) {
+        failed = true;
+      }
+      file.clear();
+      return !failed;
+    }
+
+    uint64_t FrameCount() const {
+      return frameCount;
+    }
+
+  private:
+    struct PendingChunk {
+      uint64_t firstFrame;
+      uint32_t frameCount;
+      std::vector<uint8_t> frames;
+      std::vector<uint8_t> keys;
+      std::vector<uint8_t> ram;
+    };
+
+    std::unique_ptr<PendingChunk> NewChunk() {
+      std::unique_ptr<PendingChunk> chunk;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!spare.empty()) {
+          chunk = std::move(spare.back());
+          spare.pop_back();
+        }
+      }
+      if (!chunk) {
+        chunk.reset(new PendingChunk());
+        chunk->frames.resize(chunkFrames * PACKED_FRAME_SIZE);
+        chunk->keys.resize(chunkFrames * KEYS_RECORD_SIZE);
+        chunk->ram.resize(withRam ? chunkFrames * RAM_RECORD_SIZE : 0);
+      }
+      chunk->firstFrame = frameCount;
+      chunk->frameCount = 0;
+      return chunk;
+    }
+
+    void Submit() {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return queue.size() < maxQueued; });
+        queue.push_back(std::move(current));
+      }
+      wake.notify_one();
+      current = NewChunk();
+    }
+
+    void WriterLoop() {
+      std::vector<uint8_t> column;
+      std::vector<uint8_t> encoded;
+      std::vector<uint8_t> scratch;
+
+      for (;;) {
+        std::unique_ptr<PendingChunk> chunk;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wake.wait(lock, [this] { return done || !queue.empty(); });
+          if (queue.empty()) {
+            return;
+          }
+          chunk = std::move(queue.front());
+          queue.pop_front();
+        }
+        drained.notify_one();
+
+        //After a failed write the rest is only drained, so Submit() never waits forever
+        if (failed) {
+          std::lock_guard<std::mutex> lock(mutex);
+          spare.push_back(std::move(chunk));
+          continue;
+        }
+
+        DatasetChunk entry = {};
+        entry.firstFrame = chunk->firstFrame;
+        entry.frameCount = chunk->frameCount;
+        std::vector<uint8_t>* sources[DATASET_COLUMNS] = {&chunk->frames, &chunk->keys, &chunk->ram};
+        size_t recordSizes[DATASET_COLUMNS] = {PACKED_FRAME_SIZE, KEYS_RECORD_SIZE, RAM_RECORD_SIZE};
+        for (unsigned int c = 0; c < DATASET_COLUMNS; ++c) {
+          size_t bytes = std::min(sources[c]->size(), chunk->frameCount * recordSizes[c]);
+          column.assign(sources[c]->begin(), sources[c]->begin() + bytes);
+          entry.columns[c].codec = EncodeColumn(column, recordSizes[c], encoded, scratch);
+          entry.columns[c].offset = static_cast<uint64_t>(file.tellp());
+          entry.columns[c].size = static_cast<uint32_t>(encoded.size());
+          file.write(reinterpret_cast<char const*>(encoded.data()), encoded.size());
+        }
+        if (!file.good()) {
+          failed = true;
+        }
+        index.push_back(entry);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        spare.push_back(std::move(chunk));
+      }
+    }
+
+    std::ofstream file;
+    bool withRam;
+    uint32_t chunkFrames;
+    size_t maxQueued;
+    uint64_t frameCount;
+    bool closed;
+    std::atomic<bool> failed; // set by the writer thread on a failed write
+
+    std::unique_ptr<PendingChunk> current;
+    std::vector<DatasetChunk> index; // only touched by the writer thread until Close()
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained; // a queued chunk was taken by the writer
+    std::deque<std::unique_ptr<PendingChunk>> queue;
+    std::vector<std::unique_ptr<PendingChunk>> spare;
+    bool done;
+    std::thread writer;
+};
+
+/**
+ * Random access to a frame dataset through a read-only memory mapping.
+ * Raw columns are returned in place; compressed chunks are decoded on
+ * first access and cached until a different chunk is requested.
+ */
+class DatasetReader {
+  public:
+    DatasetReader() : base(nullptr), size(0), header(nullptr), frameCount(0), cachedChunk(-1) {}
+
+    //Owns the mapping, so it cannot be copied
+    DatasetReader(DatasetReader const&) = delete;
+    DatasetReader& operator=(DatasetReader const&) = delete;
+
+    ~DatasetReader() {
+      Unmap();
+    }
+
+    //Opening again first releases the previous file
+    bool Open(char const* filename) {
+      Unmap();
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat info;
+      if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(DatasetHeader) + sizeof(DatasetFooter)) {
+        close(fd);
+        return false;
+      }
+      size = info.st_size;
+      void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (mapping == MAP_FAILED) {
+        return false;
+      }
+      base = static_cast<uint8_t const*>(mapping);
+
+      //The mapping is page aligned, so the header can be used in place; the footer and index cannot
+      header = reinterpret_cast<DatasetHeader const*>(base);
+      DatasetFooter footer;
+      memcpy(&footer, base + size - sizeof(DatasetFooter), sizeof(footer));
+      size_t indexLimit = size - sizeof(DatasetFooter);
+      if (header->magic != DATASET_MAGIC || header->version != DATASET_VERSION || footer.magic != DATASET_INDEX_MAGIC
+          || footer.indexOffset > indexLimit || footer.chunkCount > (indexLimit - footer.indexOffset) / sizeof(DatasetChunk)) {
+        Unmap();
+        return false;
+      }
+      chunks.resize(footer.chunkCount);
+      memcpy(chunks.data(), base + footer.indexOffset, chunks.size() * sizeof(DatasetChunk));
+      frameCount = chunks.empty() ? 0 : chunks.back().firstFrame + chunks.back().frameCount;
+      return true;
+    }
+
+    uint64_t FrameCount() const {
+      return frameCount;
+    }
+
+    bool HasRam() const {
+      return header && (header->flags & DATASET_HAS_RAM);
+    }
+
+    //Packed 1bpp frame (PACKED_FRAME_SIZE bytes), or null if out of range or corrupt
+    uint8_t const* Frame(uint64_t frame) {
+      return Record(frame, 0, PACKED_FRAME_SIZE);
+    }
+
+    //Keypad bitmask recorded with the frame
+    uint16_t Keys(uint64_t frame) {
+      uint8_t const* keys = Record(frame, 1, KEYS_RECORD_SIZE);
+      return keys ? static_cast<uint16_t>(keys[0] | (keys[1] << 8u)) : 0;
+    }
+
+    //RAM snapshot (4096 bytes), or null if the dataset has none
+    uint8_t const* Ram(uint64_t frame) {
+      return HasRam() ? Record(frame, 2, RAM_RECORD_SIZE) : nullptr;
+    }
+
+  private:
+    uint8_t const* Record(uint64_t frame, unsigned int column, size_t recordSize) {
+      if (frame >= frameCount) {
+        return nullptr;
+      }
+
+      //Chunks are in frame order, so binary search the index; a corrupt index may leave gaps
+      uint32_t lo = 0;
+      uint32_t hi = static_cast<uint32_t>(chunks.size());
+      while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (chunks[mid].firstFrame <= frame) lo = mid; else hi = mid;
+      }
+      DatasetChunk const& chunk = chunks[lo];
+      if (frame < chunk.firstFrame || frame - chunk.firstFrame >= chunk.frameCount || chunk.frameCount > header->chunkFrames) {
+        return nullptr;
+      }
+      DatasetColumn const& col = chunk.columns[column];
+      size_t offset = (frame - chunk.firstFrame) * recordSize;
+      size_t decodedSize = chunk.frameCount * recordSize;
+      if (col.offset > size || col.size > size - col.offset) {
+        return nullptr;
+      }
+
+      if (col.codec == CODEC_RAW) {
+        return col.size == decodedSize ? base + col.offset + offset : nullptr;
+      }
+      if (col.codec != CODEC_RLE && col.codec != CODEC_XOR_RLE) {
+        return nullptr;
+      }
+
+      if (cachedChunk != static_cast<int64_t>(lo)) {
+        for (unsigned int c = 0; c < DATASET_COLUMNS; ++c) {
+          cache[c].clear();
+        }
+        cachedChunk = lo;
+      }
+      std::vector<uint8_t>& decoded = cache[column];
+      if (decoded.empty()) {
+        decoded.resize(decodedSize);
+        if (!RleDecode(base + col.offset, col.size, decoded.data(), decodedSize)) {
+          decoded.clear();
+          return nullptr;
+        }
+        if (col.codec == CODEC_XOR_RLE) {
+          for (size_t i = recordSize; i < decodedSize; ++i) {
+            decoded[i] ^= decoded[i - recordSize];
+          }
+        }
+      }
+      return decoded.data() + offset;
+    }
+
+    void Unmap() {
+      if (base) {
+        munmap(const_cast<uint8_t*>(base), size);
+      }
+      base = nullptr;
+      size = 0;
+      header = nullptr;
+      chunks.clear();
+      frameCount = 0;
+      cachedChunk = -1;
+      for (std::vector<uint8_t>& column : cache) {
+        column.clear();
+      }
+    }
+
+    uint8_t const* base;
+    size_t size;
+    DatasetHeader const* header;
+    std::vector<DatasetChunk> chunks; // copied out of the file, where it may be unaligned
+    uint64_t frameCount;
+
+    int64_t cachedChunk;
+    std::vector<uint8_t> cache[DATASET_COLUMNS];
+};
+
+/**
+ * One headless emulator driven by a scripted input track.
+ *
+ * An idle instance can be hibernated: its Chip8 is dropped and only a
+ * compressed copy of the state is kept. Interned memory pages (ROM,
+ * font, untouched RAM) are kept as references to the shared pages;
+ * the rest of the state, with only the private pages and the video
+ * packed to 1bpp, is RLE'd. While hibernated its frames are skipped,
+ * which is exact because an idle machine does not change; it is
+ * rehydrated as soon as its input differs from the keys held when it
+ * went to sleep. An instance whose state fails to decode is marked
+ * failed and no longer runs.
+ */
+struct Instance {
+  explicit Instance(unsigned int seed)
+    : chip8(new Chip8(seed)), inputCursor(0), frames(0), cycles(0), sink(nullptr), idleFrames(0), sleepKeys(0), failed(false) {}
+
+  std::unique_ptr<Chip8> chip8; // null while hibernated
+  std::vector<uint16_t> inputs; // keypad mask per frame; the last one is held after the end
+  size_t inputCursor;
+  uint64_t frames;
+  uint64_t cycles;
+  DatasetWriter* sink; // optional, receives every emulated frame
+
+  std::vector<uint8_t> hibernated;          // compressed state while chip8 is null
+  std::vector<InternedPageRef> sleepPages;  // per page while hibernated: the shared page, or null if it is in `hibernated`
+  unsigned int idleFrames;                  // consecutive frames that ended idle
+  uint16_t sleepKeys;                       // keypad mask when hibernated
+  bool failed;                              // hibernated state was corrupt; the instance is dead
+
+  bool Hibernated() const {
+    return !chip8 && !failed;
+  }
+
+  //Compresses the state and drops the Chip8; false if the video is not plain on/off pixels
+  bool Hibernate() {
+    if (!chip8) {
+      return true;
+    }
+    Chip8State state{};
+    if (!chip8->SaveState(state)) {
+      return false;
+    }
+    for (uint32_t pixel : state.video) {
+      if (pixel != 0 && pixel != 0xFFFFFFFF) return false;
+    }
+
+    //The registers, the private pages, everything else up to the video, the packed video, then whatever follows it
+    uint8_t const* bytes = reinterpret_cast<uint8_t const*>(&state);
+    std::vector<uint8_t> flat(bytes, bytes + offsetof(Chip8State, memory));
+    std::vector<InternedPageRef> pages;
+    for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+      pages.push_back(chip8->memory.ShareInterned(p));
+      if (!pages.back()) {
+        flat.insert(flat.end(), state.memory + p * MEMORY_PAGE_SIZE, state.memory + (p + 1) * MEMORY_PAGE_SIZE);
+      }
+    }
+    flat.insert(flat.end(), reinterpret_cast<uint8_t const*>(&state.memory + 1), reinterpret_cast<uint8_t const*>(&state.video));
+    flat.resize(flat.size() + PACKED_FRAME_SIZE);
+    PackFrame(state.video, &flat[flat.size() - PACKED_FRAME_SIZE]);
+    flat.insert(flat.end(), reinterpret_cast<uint8_t const*>(&state.video + 1), reinterpret_cast<uint8_t const*>(&state + 1));
+
+    hibernated.clear();
+    RleEncode(flat.data(), flat.size(), hibernated);
+    hibernated.shrink_to_fit();
+    sleepPages = std::move(pages);
+    sleepKeys = KeypadMask(chip8->keypad);
+    chip8.reset();
+    return true;
+  }
+
+  //Decompresses the state into the given Chip8State without waking
+  bool PeekHibernated(Chip8State& state) const {
+    if (sleepPages.size() != MEMORY_PAGES) {
+      return false;
+    }
+    size_t privatePages = 0;
+    for (InternedPageRef const& page : sleepPages) {
+      privatePages += page ? 0 : 1;
+    }
+    size_t registers = offsetof(Chip8State, memory);
+    size_t afterMemory = offsetof(Chip8State, memory) + sizeof(state.memory);
+    size_t middle = offsetof(Chip8State, video) - afterMemory;
+    size_t tail = sizeof(Chip8State) - offsetof(Chip8State, video) - sizeof(state.video);
+    std::vector<uint8_t> flat(registers + privatePages * MEMORY_PAGE_SIZE + middle + PACKED_FRAME_SIZE + tail);
+    if (!RleDecode(hibernated.data(), hibernated.size(), flat.data(), flat.size())) {
+      return false;
+    }
+
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(&state);
+    uint8_t const* in = flat.data();
+    memcpy(bytes, in, registers);
+    in += registers;
+    for (unsigned int p = 0; p < MEMORY_PAGES; ++p) {
+      uint8_t const* page = sleepPages[p] ? sleepPages[p]->bytes : in;
+      memcpy(state.memory + p * MEMORY_PAGE_SIZE, page, MEMORY_PAGE_SIZE);
+      in += sleepPages[p] ? 0 : MEMORY_PAGE_SIZE;
+    }
+    memcpy(bytes + afterMemory, in, middle);
+    in += middle;
+    for (unsigned int i = 0; i < VIDEO_WIDTH * VIDEO_HEIGHT; ++i) {
+      state.video[i] = (in[i / 8] >> (7u - i % 8)) & 1u ? 0xFFFFFFFF : 0;
+    }
+    in += PACKED_FRAME_SIZE;
+    memcpy(bytes + offsetof(Chip8State, video) + sizeof(state.video), in, tail);
+    return true;
+  }
+
+  //Restores the Chip8 from the hibernated state
+  bool Rehydrate() {
+    if (chip8) {
+      return true;
+    }
+    Chip8State state;
+    if (!PeekHibernated(state)) {
+      return false;
+    }
+    chip8.reset(new Chip8(0));
+    chip8->LoadState(state);
+    DropHibernated();
+    idleFrames = 0;
+    return true;
+  }
+
+  void DropHibernated() {
+    std::vector<uint8_t>().swap(hibernated);
+    std::vector<InternedPageRef>().swap(sleepPages);
+  }
+
+  //Machine state, whether awake or hibernated
+  bool SaveState(Chip8State& state) const {
+    return chip8 ? chip8->SaveState(state) : PeekHibernated(state);
+  }
+
+  //Bytes of emulator state held for this instance (the input script and interned pages are not counted)
+  size_t ResidentBytes() const {
+    return sizeof(Instance) + (chip8 ? sizeof(Chip8) + chip8->memory.PrivateBytes() : 0) + hibernated.capacity()
+           + sleepPages.capacity() * sizeof(InternedPageRef);
+  }
+};
+
+/**
+ * Batch checkpoint file: a header followed by one fixed-size slot per
+ * instance, so every slot can be written independently through a
+ * shared mapping. The header is written last and only marks the file
+ * complete once every slot made it to disk. Input tracks are not saved:
+ * a resumed job re-adds the same instances and restores over them.
+ */
+const uint32_t CHECKPOINT_MAGIC = 0x50433843; // "C8CP"
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t instanceCount;
+  uint64_t slotSize;
+  uint32_t complete;
+  uint32_t reserved;
+};
+
+struct CheckpointSlot {
+  Chip8State state;
+  uint64_t inputCursor;
+  uint64_t frames;
+  uint64_t cycles;
+  uint32_t valid;
+  uint32_t reserved;
+};
+
+//Set from the SIGTERM handler; batch runs stop at the next frame boundary
+volatile std::sig_atomic_t stopRequested = 0;
+
+void HandleStopSignal(int) {
+  stopRequested = 1;
+}
+
+//Makes SIGTERM stop batch runs cleanly so the job can checkpoint
+void InstallStopOnSigterm() {
+  struct sigaction action = {};
+  action.sa_handler = &HandleStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, nullptr);
+}
+
+/**
+ * Writes all instances to a checkpoint with `writers` threads, each
+ * filling an interleaved share of the slots. Writers give up once the
+ * deadline on `clock` has passed; the checkpoint is only marked
+ * complete if every slot was written and synced in time.
+ */
+bool WriteCheckpoint(char const* filename, std::vector<std::unique_ptr<Instance>> const& instances,
+                     unsigned int writers, Clock& clock, Clock::Duration budget) {
+  Clock::Duration deadline = clock.Now() + budget;
+  size_t size = sizeof(CheckpointHeader) + instances.size() * sizeof(CheckpointSlot);
+  std::string temporary = std::string(filename) + ".tmp";
+
+  int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  uint8_t* base = static_cast<uint8_t*>(mapping);
+  CheckpointSlot* slots = reinterpret_cast<CheckpointSlot*>(base + sizeof(CheckpointHeader));
+
+  std::atomic<bool> ok(true);
+  std::vector<std::thread> threads;
+  writers = std::max(1u, writers);
+  for (unsigned int w = 0; w < writers; ++w) {
+    threads.emplace_back([&, w] {
+      for (size_t i = w; i < instances.size(); i += writers) {
+        if (!ok || clock.Now() > deadline) {
+          ok = false;
+          return;
+        }
+        Instance const& instance = *instances[i];
+        CheckpointSlot& slot = slots[i];
+        if (!instance.SaveState(slot.state)) {
+          ok = false;
+          return;
+        }
+        slot.inputCursor = instance.inputCursor;
+        slot.frames = instance.frames;
+        slot.cycles = instance.cycles;
+        slot.valid = 1;
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  bool complete = ok && msync(base, size, MS_SYNC) == 0 && clock.Now() <= deadline;
+  if (complete) {
+    CheckpointHeader header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, instances.size(), sizeof(CheckpointSlot), 1, 0};
+    memcpy(base, &header, sizeof(header));
+    complete = msync(base, sizeof(header), MS_SYNC) == 0;
+  }
+  munmap(base, size);
+  close(fd);
+
+  //Only replace the previous checkpoint with a complete one
+  if (complete) {
+    complete = rename(temporary.c_str(), filename) == 0;
+  } else {
+    unlink(temporary.c_str());
+  }
+  return complete;
+}
+
+//Restores instances from a complete checkpoint written for the same number of instances
+bool ReadCheckpoint(char const* filename, std::vector<std::unique_ptr<Instance>>& instances) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CheckpointHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  uint8_t const* base = static_cast<uint8_t const*>(mapping);
+  CheckpointHeader const* header = reinterpret_cast<CheckpointHeader const*>(base);
+  bool ok = header->magic == CHECKPOINT_MAGIC && header->version == CHECKPOINT_VERSION && header->complete
+    && header->slotSize == sizeof(CheckpointSlot) && header->instanceCount == instances.size()
+    && size >= sizeof(CheckpointHeader) + instances.size() * sizeof(CheckpointSlot);
+
+  CheckpointSlot const* slots = reinterpret_cast<CheckpointSlot const*>(base + sizeof(CheckpointHeader));
+  for (size_t i = 0; ok && i < instances.size(); ++i) {
+    ok = slots[i].valid;
+  }
+  for (size_t i = 0; ok && i < instances.size(); ++i) {
+    Instance& instance = *instances[i];
+    if (!instance.chip8) {
+      instance.chip8.reset(new Chip8(0));
+      instance.DropHibernated();
+      instance.failed = false;
+    }
+    instance.chip8->LoadState(slots[i].state);
+    instance.idleFrames = 0;
+    instance.inputCursor = slots[i].inputCursor;
+    instance.frames = slots[i].frames;
+    instance.cycles = slots[i].cycles;
+  }
+  munmap(const_cast<uint8_t*>(base), size);
+  return ok;
+}
+
+/**
+ * Named counters shared by the runners, schedulers and benchmarks.
+ * Counters are created on first use and keep a stable address, so hot
+ * paths can look one up once and bump it lock-free afterwards.
+ */
+class MetricsRegistry {
+  public:
+    std::atomic<uint64_t>& Counter(std::string const& name) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::unique_ptr<std::atomic<uint64_t>>& counter = counters[name];
+      if (!counter) {
+        counter.reset(new std::atomic<uint64_t>(0));
+      }
+      return *counter;
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> Snapshot() {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<std::pair<std::string, uint64_t>> values;
+      for (auto const& entry : counters) {
+        values.emplace_back(entry.first, entry.second->load());
+      }
+      return values;
+    }
+
+    void Print(FILE* out) {
+      for (auto const& entry : Snapshot()) {
+        fprintf(out, "%s %llu\n", entry.first.c_str(), static_cast<unsigned long long>(entry.second));
+      }
+    }
+
+  private:
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> counters;
+};
+
+/**
+ * Host CPU time charged to whoever ran a slice, in nanoseconds, from
+ * time-stamp counter deltas (steady-clock nanoseconds where there is no
+ * TSC). The counter keeps running while the thread is preempted, so a
+ * slice that loses its core is charged for the wait as well.
+ */
+class CpuMeter {
+  public:
+    static uint64_t Now() {
+#ifdef CHIP8_HAVE_RDTSC
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    //Adds the time since start to the account; returns the end, to start the next slice from
+    static uint64_t Charge(std::atomic<uint64_t>& account, uint64_t start) {
+      uint64_t now = Now();
+      account.fetch_add(static_cast<uint64_t>((now - start) * NanosecondsPerTick()), std::memory_order_relaxed);
+      return now;
+    }
+
+    //Calibrated once against the steady clock
+    static double NanosecondsPerTick() {
+#ifdef CHIP8_HAVE_RDTSC
+      static double scale = [] {
+        auto wallStart = std::chrono::steady_clock::now();
+        uint64_t tickStart = __rdtsc();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64_t ticks = __rdtsc() - tickStart;
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - wallStart).count();
+        return ticks ? nanoseconds / ticks : 1.0;
+      }();
+      return scale;
+#else
+      return 1.0;
+#endif
+    }
+};
+
+/**
+ * Runs many headless instances as fast as possible, spread over worker
+ * threads. Each instance is owned by exactly one worker during a run;
+ * between runs instances can be migrated to balance the load.
+ */
+class BatchRunner {
+  public:
+    /**
+     * With metrics, each instance's frames are charged to
+     * cpu.session.batch.<i>.ns, as QosScheduler charges its sessions;
+     * the registry must outlive the runner.
+     */
+    BatchRunner(unsigned int workers, unsigned int cyclesPerFrame, MetricsRegistry* metrics = nullptr)
+      : workers(workers ? workers : 1), cyclesPerFrame(cyclesPerFrame), vipTiming(false), hibernateAfter(0), metrics(metrics) {
+      if (metrics) {
+        //Calibrate now rather than inside the first run
+        CpuMeter::NanosecondsPerTick();
+      }
+    }
+
+    //Runs instances on the COSMAC VIP cycle-cost model instead of a fixed instruction count
+    void SetVipTiming(bool enabled) {
+      vipTiming = enabled;
+    }
+
+    //Hibernates instances idle for this many consecutive frames; 0 disables
+    void EnableHibernation(unsigned int idleFrames) {
+      hibernateAfter = idleFrames;
+    }
+
+    //Instances whose hibernated state could not be restored; they are skipped by every run
+    size_t FailedCount() const {
+      size_t count = 0;
+      for (std::unique_ptr<Instance> const& instance : instances) {
+        count += instance->failed ? 1 : 0;
+      }
+      return count;
+    }
+
+    size_t HibernatedCount() const {
+      size_t count = 0;
+      for (std::unique_ptr<Instance> const& instance : instances) {
+        count += instance->Hibernated() ? 1 : 0;
+      }
+      return count;
+    }
+
+    size_t Add(unsigned int seed, char const* rom) {
+      instances.emplace_back(new Instance(seed));
+      instances.back()->chip8->LoadROM(rom);
+      owners.push_back(static_cast<unsigned int>((instances.size() - 1) % workers));
+      runTimes.push_back(Clock::Duration::zero());
+      budgets.push_back(cyclesPerFrame);
+      cpu.push_back(metrics ? &metrics->Counter("cpu.session.batch." + std::to_string(instances.size() - 1) + ".ns") : nullptr);
+      return instances.size() - 1;
+    }
+
+    //Runs the ROM at the budget the index records for it, or the runner's default
+    size_t Add(unsigned int seed, char const* rom, RomIndex const& roms) {
+      size_t i = Add(seed, rom);
+      budgets[i] = roms.CyclesPerFrame(instances[i]->chip8->romHash, cyclesPerFrame);
+      return i;
+    }
+
+    Instance& Get(size_t i) {
+      return *instances[i];
+    }
+
+    size_t Size() const {
+      return instances.size();
+    }
+
+    //Shares memory pages that instances wrote back to content some instance already holds
+    void InternMemory() {
+      for (std::unique_ptr<Instance> const& instance : instances) {
+        if (instance->chip8) {
+          instance->chip8->memory.Intern();
+        }
+      }
+    }
+
+    //State held for all instances, plus every interned page in the process
+    size_t ResidentBytes() const {
+      size_t bytes = PageInterner::Global().Bytes();
+      for (std::unique_ptr<Instance> const& instance : instances) {
+        bytes += instance->ResidentBytes();
+      }
+      return bytes;
+    }
+
+    //Advances every instance by the given number of frames; false if stopped early
+    bool RunFrames(uint64_t frames) {
+      std::vector<uint64_t> targets;
+      for (std::unique_ptr<Instance> const& instance : instances) {
+        targets.push_back(instance->frames + frames);
+      }
+      return Run(targets);
+    }
+
+    //Advances every instance until it has emulated `frame` frames; false if stopped early
+    bool RunUntil(uint64_t frame) {
+      return Run(std::vector<uint64_t>(instances.size(), frame));
+    }
+
+    //Moves an instance to another worker for subsequent runs
+    void Migrate(size_t instance, unsigned int worker) {
+      owners[instance] = worker % workers;
+    }
+
+    unsigned int Owner(size_t instance) const {
+      return owners[instance];
+    }
+
+    //Reassigns instances so each worker gets a similar share of last run's time
+    void Rebalance() {
+      std::vector<size_t> order(instances.size());
+      for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+      std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return runTimes[a] > runTimes[b]; });
+
+      std::vector<Clock::Duration> load(workers, Clock::Duration::zero());
+      for (size_t i : order) {
+        unsigned int lightest = static_cast<unsigned int>(std::min_element(load.begin(), load.end()) - load.begin());
+        owners[i] = lightest;
+        load[lightest] += runTimes[i];
+      }
+    }
+
+    //Checkpoints every instance within the time budget, using `writers` threads
+    bool Checkpoint(char const* filename, unsigned int writers, Clock& clock, Clock::Duration budget) {
+      return WriteCheckpoint(filename, instances, writers, clock, budget);
+    }
+
+    //Resumes every instance from a checkpoint of the same job
+    bool Restore(char const* filename) {
+      return ReadCheckpoint(filename, instances);
+    }
+
+  private:
+    bool Run(std::vector<uint64_t> const& targets) {
+      std::vector<std::thread> threads;
+      for (unsigned int w = 0; w < workers; ++w) {
+        threads.emplace_back([this, w, &targets] {
+          RealClock clock;
+          for (size_t i = 0; i < instances.size(); ++i) {
+            if (owners[i] != w) {
+              continue;
+            }
+            Clock::Duration start = clock.Now();
+            Instance& instance = *instances[i];
+            uint64_t tick = cpu[i] ? CpuMeter::Now() : 0;
+            while (instance.frames < targets[i] && !instance.failed && !stopRequested) {
+              StepFrame(instance, budgets[i]);
+              if (cpu[i]) {
+                tick = CpuMeter::Charge(*cpu[i], tick);
+              }
+            }
+            runTimes[i] = clock.Now() - start;
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      return !stopRequested;
+    }
+
+    void StepFrame(Instance& instance, unsigned int budget) {
+      uint16_t keys = 0;
+      bool scripted = !instance.inputs.empty();
+      if (scripted) {
+        size_t cursor = instance.inputCursor < instance.inputs.size() ? instance.inputCursor : instance.inputs.size() - 1;
+        keys = instance.inputs[cursor];
+      }
+      ++instance.inputCursor;
+
+      if (instance.Hibernated()) {
+        if (!scripted || keys == instance.sleepKeys) {
+          instance.cycles += vipTiming ? 0 : budget;
+          ++instance.frames;
+          return;
+        }
+        if (!instance.Rehydrate()) {
+          instance.failed = true;
+          instance.DropHibernated();
+          return;
+        }
+      }
+
+      Chip8& chip8 = *instance.chip8;
+      if (scripted) {
+        ApplyKeypadMask(keys, chip8.keypad);
+      }
+      if (vipTiming) {
+        instance.cycles += chip8.RunVipFrame();
+      } else {
+        chip8.RunFrame(budget);
+        instance.cycles += budget;
+      }
+      ++instance.frames;
+
+      if (instance.sink) {
+        instance.sink->Append(chip8.video, chip8.keypad, &chip8.memory);
+      } else if (hibernateAfter) {
+        instance.idleFrames = chip8.IsIdle() ? instance.idleFrames + 1 : 0;
+        if (instance.idleFrames >= hibernateAfter && !instance.Hibernate()) {
+          instance.idleFrames = 0;
+        }
+      }
+    }
+
+    unsigned int workers;
+    unsigned int cyclesPerFrame;
+    std::vector<std::unique_ptr<Instance>> instances;
+    std::vector<unsigned int> owners;
+    std::vector<Clock::Duration> runTimes;
+    std::vector<unsigned int> budgets; // cycles per frame of each instance
+    std::vector<std::atomic<uint64_t>*> cpu; // null without metrics
+    bool vipTiming;
+    unsigned int hibernateAfter;
+    MetricsRegistry* metrics;
+};
+
+/**
+ * Result of one benchmark: how many operations ran in how long.
+ */
+struct BenchmarkResult {
+  std::string name;
+  uint64_t operations;
+  double seconds;
+
+  double Rate() const {
+    return seconds > 0 ? operations / seconds : 0;
+  }
+};
+
+//Times a body that performs the given number of operations, on wall-clock time
+template <typename Body>
+BenchmarkResult RunBenchmark(std::string const& name, uint64_t operations, Body body) {
+  RealClock clock;
+  Clock::Duration start = clock.Now();
+  body();
+  Clock::Duration elapsed = clock.Now() - start;
+  return BenchmarkResult{name, operations, std::chrono::duration<double>(elapsed).count()};
+}
+
+void PrintBenchmark(BenchmarkResult const& result, char const* unit) {
+  printf("%-32s %12llu ops %10.3f ms %14.0f %s/sec\n", result.name.c_str(),
+         static_cast<unsigned long long>(result.operations), result.seconds * 1000.0, result.Rate(), unit);
+}
+
+enum ObservationType {
+  OBS_UINT8,   // 0 or 255 per pixel
+  OBS_FLOAT32  // 0.0f or 1.0f per pixel
+};
+
+struct ObservationConfig {
+  ObservationType type = OBS_UINT8;
+  bool maxPool = true;        // OR each frame with the previous one to remove sprite flicker
+  unsigned int downscale = 1; // 1 or 2 (2x2 max pooling to 32x16)
+  unsigned int cropX = 0;     // crop window, in downscaled pixels
+  unsigned int cropY = 0;
+  unsigned int cropWidth = 0; // 0 = to the right/bottom edge
+  unsigned int cropHeight = 0;
+  unsigned int stack = 4;     // frames per observation, oldest first
+};
+
+//Unpacks the top `width` bits of an MSB-aligned row into one value per pixel
+void UnpackRowScalar(uint64_t bits, unsigned int width, ObservationType type, void* out) {
+  if (type == OBS_UINT8) {
+    uint8_t* dst = static_cast<uint8_t*>(out);
+    for (unsigned int x = 0; x < width; ++x) {
+      dst[x] = (bits >> (63u - x)) & 1u ? 255u : 0u;
+    }
+  } else {
+    float* dst = static_cast<float*>(out);
+    for (unsigned int x = 0; x < width; ++x) {
+      dst[x] = (bits >> (63u - x)) & 1u ? 1.0f : 0.0f;
+    }
+  }
+}
+
+#ifdef CHIP8_HAVE_AVX2_KERNELS
+/**
+ * AVX2 row unpack. 32 pixels per step for bytes: each bit's byte is
+ * shuffled into its lane, ANDed with the bit and compared. 8 pixels per
+ * step for floats: one bit per 32-bit lane, compared and ANDed with 1.0f.
+ */
+__attribute__((target("avx2")))
+void UnpackRowAvx2(uint64_t bits, unsigned int width, ObservationType type, void* out) {
+  unsigned int x = 0;
+  if (type == OBS_UINT8) {
+    uint8_t* dst = static_cast<uint8_t*>(out);
+    const __m256i shuffle = _mm256_setr_epi8(3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2,
+                                             1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i bitMask = _mm256_set1_epi64x(static_cast<long long>(0x0102040810204080ull));
+    for (; x + 32 <= width; x += 32) {
+      uint32_t word = static_cast<uint32_t>(bits >> (32u - x));
+      __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(word)), shuffle);
+      __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bitMask), bitMask);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), set);
+    }
+  } else {
+    float* dst = static_cast<float*>(out);
+    const __m256i bitMask = _mm256_setr_epi32(static_cast<int>(0x80000000u), 0x40000000, 0x20000000, 0x10000000,
+                                              0x08000000, 0x04000000, 0x02000000, 0x01000000);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    for (; x + 8 <= width; x += 8) {
+      __m256i word = _mm256_set1_epi32(static_cast<int>((bits << x) >> 32u));
+      __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(word, bitMask), bitMask);
+      _mm256_storeu_ps(dst + x, _mm256_and_ps(_mm256_castsi256_ps(set), one));
+    }
+  }
+  if (x < width) {
+    size_t elementSize = type == OBS_UINT8 ? 1 : sizeof(float);
+    UnpackRowScalar(bits << x, width - x, type, static_cast<uint8_t*>(out) + x * elementSize);
+  }
+}
+#endif
+
+/**
+ * Turns packed frames into stacked observation planes for agents. Per
+ * environment it keeps the previous packed frame (for max pooling) and
+ * the last `stack` preprocessed frames as bit rows, and every Push()
+ * writes the full stack into that environment's slot of a caller-owned
+ * batch tensor laid out [batch][stack][height][width].
+ */
+class ObservationPipeline {
+  public:
+    ObservationPipeline(ObservationConfig const& config, size_t batchSize)
+      : config(config), unpack(&UnpackRowScalar)
+    {
+      if (this->config.downscale != 2) this->config.downscale = 1;
+      if (this->config.stack == 0) this->config.stack = 1;
+      unsigned int fullWidth = VIDEO_WIDTH / this->config.downscale;
+      unsigned int fullHeight = VIDEO_HEIGHT / this->config.downscale;
+      this->config.cropX = std::min(this->config.cropX, fullWidth - 1);
+      this->config.cropY = std::min(this->config.cropY, fullHeight - 1);
+      width = this->config.cropWidth ? std::min(this->config.cropWidth, fullWidth - this->config.cropX) : fullWidth - this->config.cropX;
+      height = this->config.cropHeight ? std::min(this->config.cropHeight, fullHeight - this->config.cropY) : fullHeight - this->config.cropY;
+
+      envs.resize(batchSize);
+      for (Environment& env : envs) {
+        env.history.assign(this->config.stack * height, 0);
+      }
+#ifdef CHIP8_HAVE_AVX2_KERNELS
+      if (__builtin_cpu_supports("avx2")) {
+        unpack = &UnpackRowAvx2;
+      }
+#endif
+    }
+
+    unsigned int Width() const { return width; }
+    unsigned int Height() const { return height; }
+
+    //Bytes of one environment's observation in the batch tensor
+    size_t ObservationSize() const {
+      return static_cast<size_t>(config.stack) * height * width * (config.type == OBS_UINT8 ? 1 : sizeof(float));
+    }
+
+    bool UsingAvx2() const {
+      return unpack != &UnpackRowScalar;
+    }
+
+    //Forces the portable kernels, for benchmarking against them
+    void DisableSimd() {
+      unpack = &UnpackRowScalar;
+    }
+
+    //Clears an environment's history, e.g. at episode start
+    void Reset(size_t env) {
+      std::fill(envs[env].history.begin(), envs[env].history.end(), 0);
+      memset(envs[env].previous, 0, sizeof(envs[env].previous));
+      envs[env].newest = 0;
+    }
+
+    //Adds one packed frame (PACKED_FRAME_SIZE bytes) and writes the stacked observation
+    void Push(size_t env, uint8_t const* packed, void* batchTensor) {
+      Environment& e = envs[env];
+      uint64_t rows[VIDEO_HEIGHT];
+      for (unsigned int y = 0; y < VIDEO_HEIGHT; ++y) {
+        uint64_t row = 0;
+        for (unsigned int b = 0; b < 8; ++b) {
+          row = (row << 8u) | packed[y * 8 + b];
+        }
+        rows[y] = config.maxPool ? row | e.previous[y] : row;
+        e.previous[y] = row;
+      }
+
+      if (config.downscale == 2) {
+        for (unsigned int y = 0; y < VIDEO_HEIGHT / 2; ++y) {
+          rows[y] = CompressPairs(rows[2 * y] | rows[2 * y + 1]);
+        }
+      }
+
+      e.newest = (e.newest + 1) % config.stack;
+      uint64_t* slot = &e.history[e.newest * height];
+      for (unsigned int y = 0; y < height; ++y) {
+        slot[y] = rows[config.cropY + y] << config.cropX;
+      }
+
+      size_t elementSize = config.type == OBS_UINT8 ? 1 : sizeof(float);
+      uint8_t* out = static_cast<uint8_t*>(batchTensor) + env * ObservationSize();
+      for (unsigned int k = 0; k < config.stack; ++k) {
+        uint64_t const* frame = &e.history[((e.newest + 1 + k) % config.stack) * height];
+        for (unsigned int y = 0; y < height; ++y) {
+          unpack(frame[y], width, config.type, out);
+          out += width * elementSize;
+        }
+      }
+    }
+
+  private:
+    struct Environment {
+      uint64_t previous[VIDEO_HEIGHT] = {};
+      std::vector<uint64_t> history; // stack frames of `height` MSB-aligned rows, ring ordered
+      unsigned int newest = 0;
+    };
+
+    //ORs horizontal pixel pairs and packs the 32 results into the top half
+    static uint64_t CompressPairs(uint64_t row) {
+      uint64_t x = (row | (row << 1u)) >> 1u;
+      x &= 0x5555555555555555ull;
+      x = (x | (x >> 1u)) & 0x3333333333333333ull;
+      x = (x | (x >> 2u)) & 0x0F0F0F0F0F0F0F0Full;
+      x = (x | (x >> 4u)) & 0x00FF00FF00FF00FFull;
+      x = (x | (x >> 8u)) & 0x0000FFFF0000FFFFull;
+      x = (x | (x >> 16u)) & 0x00000000FFFFFFFFull;
+      return x << 32u;
+    }
+
+    ObservationConfig config;
+    unsigned int width;
+    unsigned int height;
+    std::vector<Environment> envs;
+    void (*unpack)(uint64_t, unsigned int, ObservationType, void*);
+};
+
+/**
+ * Observations/sec for a batch of environments, SIMD against portable
+ * kernels, for both output types.
+ */
+std::vector<BenchmarkResult> BenchmarkObservations(size_t batchSize = 64, uint64_t steps = 2000) {
+  std::vector<uint8_t> frames(batchSize * PACKED_FRAME_SIZE);
+  std::mt19937 rng(1);
+  for (uint8_t& byte : frames) {
+    byte = static_cast<uint8_t>(rng());
+  }
+
+  std::vector<BenchmarkResult> results;
+  ObservationType types[] = {OBS_UINT8, OBS_FLOAT32};
+  for (ObservationType type : types) {
+    for (int simd = 1; simd >= 0; --simd) {
+      ObservationConfig config;
+      config.type = type;
+      ObservationPipeline pipeline(config, batchSize);
+      if (!simd) {
+        pipeline.DisableSimd();
+      } else if (!pipeline.UsingAvx2()) {
+        continue;
+      }
+      std::vector<uint8_t> tensor(batchSize * pipeline.ObservationSize());
+      char const* name = type == OBS_UINT8 ? (simd ? "observations uint8 avx2" : "observations uint8 scalar")
+                                           : (simd ? "observations float avx2" : "observations float scalar");
+      results.push_back(RunBenchmark(name, batchSize * steps, [&] {
+        for (uint64_t step = 0; step < steps; ++step) {
+          for (size_t env = 0; env < batchSize; ++env) {
+            pipeline.Push(env, &frames[env * PACKED_FRAME_SIZE], tensor.data());
+          }
+        }
+      }));
+    }
+  }
+  return results;
+}
+
+/**
+ * Host package energy from the Linux powercap RAPL zones
+ * (/sys/class/powercap/intel-rapl:N, which AMD parts expose too). Only
+ * top-level "package-*" zones are summed, since the core, uncore and
+ * dram subzones are already included in them. Counters wrap at
+ * max_energy_range_uj and are usually readable only by root. Without a
+ * readable zone Available() is false and callers skip energy entirely.
+ * Readings cover the whole package, so other load on the host counts.
+ */
+class EnergyMeter {
+  public:
+    explicit EnergyMeter(std::string const& root = "/sys/class/powercap") : total(0) {
+      DIR* directory = opendir(root.c_str());
+      if (!directory) {
+        return;
+      }
+      while (dirent* entry = readdir(directory)) {
+        std::string name = entry->d_name;
+        if (name.rfind("intel-rapl:", 0) != 0 || name.find(':', 11) != std::string::npos) {
+          continue;
+        }
+        Zone zone{root + "/" + name + "/energy_uj", 0, 0};
+        std::ifstream label(root + "/" + name + "/name");
+        std::string kind;
+        if (label >> kind && kind.rfind("package", 0) == 0 && ReadCounter(zone.path, zone.last)
+            && ReadCounter(root + "/" + name + "/max_energy_range_uj", zone.range)) {
+          zones.push_back(zone);
+        }
+      }
+      closedir(directory);
+    }
+
+    bool Available() const {
+      return !zones.empty();
+    }
+
+    //Microjoules used by all packages since construction; call at least once per counter wrap (minutes)
+    uint64_t Microjoules() {
+      for (Zone& zone : zones) {
+        uint64_t now;
+        if (!ReadCounter(zone.path, now)) {
+          continue;
+        }
+        total += now >= zone.last ? now - zone.last : zone.range - zone.last + now;
+        zone.last = now;
+      }
+      return total;
+    }
+
+    //Adds the energy since the previous call to the account, like CpuMeter::Charge
+    void Charge(std::atomic<uint64_t>& account) {
+      uint64_t before = total;
+      account.fetch_add(Microjoules() - before, std::memory_order_relaxed);
+    }
+
+  private:
+    struct Zone {
+      std::string path;
+      uint64_t range;
+      uint64_t last;
+    };
+
+    static bool ReadCounter(std::string const& path, uint64_t& value) {
+      std::ifstream file(path);
+      unsigned long long read;
+      if (!(file >> read)) {
+        return false;
+      }
+      value = read;
+      return true;
+    }
+
+    std::vector<Zone> zones;
+    uint64_t total;
+};
+
+/**
+ * Checks EnergyMeter against a fake powercap tree built in a temporary
+ * directory: two package zones, one about to wrap, beside a core
+ * subzone and a psys zone that must not be counted. Returns what first
+ * disagreed, or an empty string.
+ */
+std::string VerifyEnergyMeter() {
+  char root[] = "/tmp/chip8-powercap-XXXXXX";
+  if (!mkdtemp(root)) {
+    return "cannot create a temporary directory";
+  }
+  std::vector<std::string> files;
+  std::vector<std::string> directories;
+  auto write = [&](std::string const& zone, char const* file, std::string const& value) {
+    std::string directory = std::string(root) + "/" + zone;
+    if (std::find(directories.begin(), directories.end(), directory) == directories.end()) {
+      mkdir(directory.c_str(), 0700);
+      directories.push_back(directory);
+    }
+    std::string path = directory + "/" + file;
+    std::ofstream(path, std::ios::trunc) << value << "\n";
+    if (std::find(files.begin(), files.end(), path) == files.end()) {
+      files.push_back(path);
+    }
+  };
+  auto zone = [&](std::string const& name, std::string const& label, uint64_t energy) {
+    write(name, "name", label);
+    write(name, "energy_uj", std::to_string(energy));
+    write(name, "max_energy_range_uj", "5000");
+  };
+
+  std::string failure;
+  EnergyMeter empty(root);
+  zone("intel-rapl:0", "package-0", 1000);
+  zone("intel-rapl:0:0", "core", 1000);
+  zone("intel-rapl:1", "psys", 1000);
+  zone("intel-rapl:2", "package-1", 4900);
+  EnergyMeter meter(root);
+  if (empty.Available() || EnergyMeter(std::string(root) + "/missing").Available()) {
+    failure = "available without a package zone";
+  } else if (!meter.Available()) {
+    failure = "package zones not found";
+  } else if (uint64_t used = meter.Microjoules(); used != 0) {
+    failure = "reads " + std::to_string(used) + " uJ before any energy was used";
+  }
+  if (failure.empty()) {
+    //500 uJ on package-0 and 200 across the wrap on package-1; core and psys do not count
+    zone("intel-rapl:0", "package-0", 1500);
+    zone("intel-rapl:0:0", "core", 1400);
+    zone("intel-rapl:1", "psys", 3000);
+    zone("intel-rapl:2", "package-1", 100);
+    if (uint64_t used = meter.Microjoules(); used != 700) {
+      failure = "reads " + std::to_string(used) + " uJ, expected 700";
+    }
+  }
+  if (failure.empty()) {
+    std::atomic<uint64_t> account{0};
+    zone("intel-rapl:0", "package-0", 1600);
+    meter.Charge(account);
+    meter.Charge(account);
+    if (account.load() != 100) {
+      failure = "charges " + std::to_string(account.load()) + " uJ, expected 100";
+    }
+  }
+
+  for (std::string const& path : files) {
+    unlink(path.c_str());
+  }
+  for (std::string const& directory : directories) {
+    rmdir(directory.c_str());
+  }
+  rmdir(root);
+  return failure;
+}
+
+enum QosClass {
+  QOS_INTERACTIVE, // one frame per 60 Hz period, each with a hard deadline
+  QOS_BATCH,       // as many frames as the remaining capacity allows
+  QOS_CLASSES
+};
+
+struct QosClassReport {
+  uint64_t frames;
+  uint64_t deadlineMisses;
+  double framesPerSecond;
+};
+
+/**
+ * Single-threaded QoS scheduler. Every 60 Hz period each interactive
+ * session is released and must finish its frame by the end of the
+ * period. The rest of the period is backfilled with batch sessions,
+ * round robin, in slices of instructions sized from the measured cost
+ * per instruction so that backfill stops a guard interval before the
+ * next release. Whenever an interactive frame misses its deadline, or
+ * is predicted to finish inside the guard (a late release plus the
+ * measured interactive cost), the guard doubles (up to half a period),
+ * throttling batch work; it decays again while deadlines are safe. A
+ * batch frame that spans more than one period counts as a batch
+ * deadline miss: that session is running behind real time.
+ *
+ * Where EnergyMeter can read RAPL, package energy is added to
+ * energy.package.uj every period; divided by the frame counters it
+ * gives joules per frame.
+ */
+class QosScheduler {
+  public:
+    QosScheduler(Clock& clock, MetricsRegistry& metrics)
+      : clock(clock), metrics(metrics), nextBatch(0), instructionCost(0), interactiveCost(0), guard(MinGuard()),
+        frames{&metrics.Counter("scheduler.interactive.frames"), &metrics.Counter("scheduler.batch.frames")},
+        misses{&metrics.Counter("scheduler.interactive.deadline_misses"), &metrics.Counter("scheduler.batch.deadline_misses")},
+        throttled(metrics.Counter("scheduler.batch.throttled_periods")),
+        frontendCpu(metrics.Counter("cpu.frontend.ns")),
+        energyAccount(energy.Available() ? &metrics.Counter("energy.package.uj") : nullptr) {
+      //Calibrate now rather than inside the first period
+      CpuMeter::NanosecondsPerTick();
+    }
+
+    /**
+     * onFrame runs after each frame, e.g. to poll input and present; its
+     * time is charged to cpu.frontend.ns, the frame's to
+     * cpu.session.<name>.ns (name defaults to interactive.<n>).
+     */
+    void AddInteractive(Chip8& chip8, unsigned int cyclesPerFrame, std::function<void()> onFrame = nullptr, std::string name = "") {
+      std::atomic<uint64_t>& cpu = CpuAccount(name.empty() ? "interactive." + std::to_string(interactive.size()) : name);
+      interactive.push_back(Session{&chip8, cyclesPerFrame, 0, onFrame, &cpu});
+    }
+
+    //Adds the loaded ROM at the budget the index records for it, or fallback
+    void AddInteractive(Chip8& chip8, RomIndex const& roms, unsigned int fallback, std::function<void()> onFrame = nullptr, std::string name = "") {
+      AddInteractive(chip8, roms.CyclesPerFrame(chip8.romHash, fallback), std::move(onFrame), std::move(name));
+    }
+
+    //Slices are charged to cpu.session.<name>.ns (name defaults to batch.<n>)
+    void AddBatch(Chip8& chip8, unsigned int cyclesPerFrame, std::string name = "") {
+      std::atomic<uint64_t>& cpu = CpuAccount(name.empty() ? "batch." + std::to_string(batch.size()) : name);
+      batch.push_back(Session{&chip8, cyclesPerFrame, 0, nullptr, &cpu});
+    }
+
+    void AddBatch(Chip8& chip8, RomIndex const& roms, unsigned int fallback, std::string name = "") {
+      AddBatch(chip8, roms.CyclesPerFrame(chip8.romHash, fallback), std::move(name));
+    }
+
+    //Schedules for the given amount of clock time and reports per-class results
+    std::vector<QosClassReport> RunFor(Clock::Duration duration) {
+      uint64_t startFrames[QOS_CLASSES] = {frames[QOS_INTERACTIVE]->load(), frames[QOS_BATCH]->load()};
+      uint64_t startMisses[QOS_CLASSES] = {misses[QOS_INTERACTIVE]->load(), misses[QOS_BATCH]->load()};
+      Clock::Duration start = clock.Now();
+
+      for (uint64_t period = 0; PeriodStart(period) < duration; ++period) {
+        Clock::Duration release = start + PeriodStart(period);
+        Clock::Duration deadline = start + PeriodStart(period + 1);
+        clock.SleepUntil(release);
+
+        //A late release (batch overran) plus the usual interactive work would cut into the guard
+        Clock::Duration interactiveStart = clock.Now();
+        bool atRisk = !interactive.empty() && interactiveStart + Clock::Duration(interactiveCost) > deadline - guard;
+        bool missed = false;
+        for (Session& session : interactive) {
+          uint64_t tick = CpuMeter::Now();
+          session.chip8->RunFrame(session.cyclesPerFrame);
+          tick = CpuMeter::Charge(*session.cpu, tick);
+          if (session.onFrame) {
+            session.onFrame();
+            CpuMeter::Charge(frontendCpu, tick);
+          }
+          frames[QOS_INTERACTIVE]->fetch_add(1);
+          if (clock.Now() > deadline) {
+            misses[QOS_INTERACTIVE]->fetch_add(1);
+            missed = true;
+          }
+        }
+
+        Clock::Duration::rep sample = (clock.Now() - interactiveStart).count();
+        interactiveCost = interactiveCost ? interactiveCost + (sample - interactiveCost) / 8 : sample;
+
+        if (missed || atRisk) {
+          guard = std::min(guard * 2, PeriodStart(1) / 2);
+          throttled.fetch_add(1);
+        } else {
+          guard = std::max(guard - guard / 8, MinGuard());
+        }
+
+        if (!missed) {
+          Backfill(deadline - guard);
+        }
+        if (energyAccount) {
+          energy.Charge(*energyAccount);
+        }
+      }
+
+      double seconds = std::chrono::duration<double>(clock.Now() - start).count();
+      std::vector<QosClassReport> report(QOS_CLASSES);
+      for (unsigned int c = 0; c < QOS_CLASSES; ++c) {
+        report[c].frames = frames[c]->load() - startFrames[c];
+        report[c].deadlineMisses = misses[c]->load() - startMisses[c];
+        report[c].framesPerSecond = seconds > 0 ? report[c].frames / seconds : 0;
+      }
+      return report;
+    }
+
+  private:
+    struct Session {
+      Chip8* chip8;
+      unsigned int cyclesPerFrame;
+      unsigned int done; // instructions of the current frame already run (batch only)
+      std::function<void()> onFrame;
+      std::atomic<uint64_t>* cpu;
+      Clock::Duration started{}; // when the current frame's first slice ran (batch only)
+    };
+
+    std::atomic<uint64_t>& CpuAccount(std::string const& name) {
+      return metrics.Counter("cpu.session." + name + ".ns");
+    }
+
+    static Clock::Duration PeriodStart(uint64_t period) {
+      return Clock::Duration(static_cast<Clock::Duration::rep>(period * 1000000000ull / TIMER_HZ));
+    }
+
+    static Clock::Duration MinGuard() {
+      return PeriodStart(1) / 20;
+    }
+
+    /**
+     * Runs batch slices until the stop time would be overrun. Time is
+     * the later of the clock and the time the slices so far should have
+     * taken at the measured cost, so a clock that does not move while
+     * we work (VirtualClock) still ends the backfill.
+     */
+    void Backfill(Clock::Duration stop) {
+      const unsigned int FIRST_SLICE = 64;
+      Clock::Duration planned = clock.Now();
+      while (!batch.empty()) {
+        Clock::Duration now = std::max(clock.Now(), planned);
+        if (now >= stop) {
+          return;
+        }
+        uint64_t budget = instructionCost > 0 ? (stop - now).count() / instructionCost : FIRST_SLICE;
+        if (budget == 0) {
+          return;
+        }
+
+        Session& session = batch[nextBatch];
+        unsigned int slice = static_cast<unsigned int>(std::min<uint64_t>(budget, session.cyclesPerFrame - session.done));
+        if (session.done == 0) {
+          session.started = now;
+        }
+        Clock::Duration measuredStart = clock.Now();
+        uint64_t tick = CpuMeter::Now();
+        for (unsigned int i = 0; i < slice; ++i) {
+          session.chip8->Cycle();
+        }
+        session.done += slice;
+        if (session.done == session.cyclesPerFrame) {
+          session.chip8->TickTimers();
+          session.done = 0;
+          frames[QOS_BATCH]->fetch_add(1);
+          //A batch frame has no hard deadline, but one that took longer than a period ran behind real time
+          if (std::max(clock.Now(), now + Clock::Duration(slice * instructionCost)) - session.started > PeriodStart(1)) {
+            misses[QOS_BATCH]->fetch_add(1);
+          }
+          nextBatch = (nextBatch + 1) % batch.size();
+        }
+        uint64_t ticks = CpuMeter::Charge(*session.cpu, tick) - tick;
+
+        //Running average of nanoseconds per instruction, new sample weighted 1/8; host time bounds it from below for virtual clocks
+        Clock::Duration::rep elapsed = std::max<Clock::Duration::rep>((clock.Now() - measuredStart).count(), ticks * CpuMeter::NanosecondsPerTick());
+        Clock::Duration::rep sample = slice ? elapsed / slice : 0;
+        instructionCost = instructionCost ? instructionCost + (sample - instructionCost) / 8 : std::max<Clock::Duration::rep>(sample, 1);
+        instructionCost = std::max<Clock::Duration::rep>(instructionCost, 1);
+        planned = now + Clock::Duration(slice * instructionCost);
+      }
+    }
+
+    Clock& clock;
+    MetricsRegistry& metrics;
+    std::vector<Session> interactive;
+    std::vector<Session> batch;
+    size_t nextBatch;
+    Clock::Duration::rep instructionCost; // ns per batch instruction
+    Clock::Duration::rep interactiveCost; // ns for all interactive frames of a period
+    Clock::Duration guard;
+    std::atomic<uint64_t>* frames[QOS_CLASSES];
+    std::atomic<uint64_t>* misses[QOS_CLASSES];
+    std::atomic<uint64_t>& throttled;
+    std::atomic<uint64_t>& frontendCpu;
+    EnergyMeter energy;
+    std::atomic<uint64_t>* energyAccount; // energy.package.uj, null without RAPL
+};
+
+/**
+ * Small synthetic ROMs for benchmarks, each an endless loop stressing
+ * one part of the interpreter.
+ */
+struct SyntheticRom {
+  char const* name;
+  std::vector<uint8_t> code;
+};
+
+std::vector<SyntheticRom> SyntheticRoms() {
+  return {
+    //Register arithmetic and skips
+    {"alu", {0x60, 0x01, 0x61, 0x02, 0x80, 0x14, 0x81, 0x05, 0x82, 0x03, 0x70, 0x03, 0x30, 0x10,
+             0x71, 0x01, 0x83, 0x06, 0x84, 0x0E, 0x50, 0x10, 0x72, 0x01, 0x12, 0x04}},
+    //Font sprites drawn at random positions
+    {"draw", {0xC0, 0x3F, 0xC1, 0x0F, 0xA0, 0x50, 0xD0, 0x15, 0x12, 0x00}},
+    //BCD and register block stores and loads
+    {"memory", {0xA3, 0x00, 0xC5, 0xFF, 0xF5, 0x33, 0xF7, 0x55, 0xF7, 0x65, 0xF5, 0x1E, 0x12, 0x00}},
+    //Subroutine calls, timers and a bit of everything
+    {"mixed", {0x22, 0x08, 0xF0, 0x15, 0xF1, 0x07, 0x12, 0x00, 0x80, 0x14, 0xC2, 0x07,
+               0xA0, 0x50, 0xD2, 0x25, 0x00, 0xEE}},
+    //ALU, draw and memory loops marked as host-call regions 1-3, counter 0 counts passes
+    {"phases", {0x0F, 0x11, 0x61, 0x00, 0x71, 0x01, 0x82, 0x14, 0x31, 0x00, 0x12, 0x04, 0x0F, 0x12,
+                0x0F, 0x21, 0xA0, 0x50, 0x63, 0x00, 0xD3, 0x05, 0x73, 0x01, 0x33, 0x40, 0x12, 0x14, 0x0F, 0x22,
+                0x0F, 0x31, 0xA3, 0x00, 0x64, 0x00, 0xF5, 0x33, 0xF7, 0x55, 0xF7, 0x65, 0x74, 0x01, 0x34, 0x40,
+                0x12, 0x24, 0x0F, 0x32, 0x0F, 0x03, 0x12, 0x00}},
+  };
+}
+
+//The synthetic ROM with the given name, or one with no code if there is none
+SyntheticRom SyntheticRomNamed(char const* name) {
+  for (SyntheticRom& rom : SyntheticRoms()) {
+    if (strcmp(rom.name, name) == 0) {
+      return rom;
+    }
+  }
+  return {name, {}};
+}
+
+/**
+ * Random program of size bytes for stress runs. About half the
+ * instructions are drawn from the jump, call, return, I and memory
+ * families, so runs soon reach computed jumps past 0xFFF, unbalanced
+ * returns, deep calls and accesses that wrap.
+ */
+std::vector<uint8_t> RandomRom(std::mt19937& rng, size_t size) {
+  static const uint8_t FAMILIES[] = {0x00, 0x10, 0x20, 0x30, 0x70, 0xA0, 0xB0, 0xD0, 0xE0, 0xF0};
+  static const uint8_t F_LOW[] = {0x0A, 0x1E, 0x29, 0x33, 0x55, 0x65};
+  std::vector<uint8_t> rom(size & ~static_cast<size_t>(1));
+  for (uint8_t& byte : rom) {
+    byte = static_cast<uint8_t>(rng());
+  }
+  for (size_t i = 0; i + 1 < rom.size(); i += 2) {
+    if (rng() % 2) {
+      continue;
+    }
+    rom[i] = FAMILIES[rng() % sizeof(FAMILIES)] | (rom[i] & 0x0Fu);
+    if (rom[i] < 0x10) {
+      rom[i + 1] = (rom[i + 1] & 0xF0u) | 0x0Eu; // 0nnE returns
+    } else if ((rom[i] & 0xF0u) == 0xF0) {
+      rom[i + 1] = F_LOW[rng() % sizeof(F_LOW)];
+    }
+  }
+  return rom;
+}
+
+/**
+ * Runs count random programs on the table and switch interpreters with
+ * random keys held, to drive every guest access path into its edge
+ * cases. Build with -fsanitize=address,undefined to check that none
+ * leaves its array. Returns the instructions run.
+ */
+uint64_t StressRandomRoms(unsigned int count = 300, uint64_t frames = 60, unsigned int cyclesPerFrame = 1000, unsigned int seed = 1) {
+  std::mt19937 rng(seed);
+  uint64_t instructions = 0;
+  for (unsigned int i = 0; i < count; ++i) {
+    std::vector<uint8_t> rom = RandomRom(rng, 64 + rng() % (MEMORY_SIZE - START_ADDRESS - 64));
+    uint16_t keys = static_cast<uint16_t>(rng());
+    Chip8 tables(i);
+    Chip8 switched(i);
+    tables.LoadROM(rom.data(), rom.size());
+    switched.LoadROM(rom.data(), rom.size());
+    ApplyKeypadMask(keys, tables.keypad);
+    ApplyKeypadMask(keys, switched.keypad);
+    for (uint64_t f = 0; f < frames; ++f) {
+      tables.RunFrame(cyclesPerFrame);
+      for (unsigned int c = 0; c < cyclesPerFrame; ++c) {
+        switched.CycleSwitch();
+      }
+      switched.TickTimers();
+      instructions += 2ull * cyclesPerFrame;
+    }
+  }
+  return instructions;
+}
+
+/**
+ * Emulated instructions/sec of the fixed-count run loop against the VIP
+ * cycle-cost model on the synthetic ROMs. The VIP run uses the same
+ * number of frames with the display wait disabled, so both modes do
+ * comparable work per frame.
+ */
+std::vector<BenchmarkResult> BenchmarkVipTiming(uint64_t frames = 20000) {
+  std::vector<BenchmarkResult> results;
+  for (SyntheticRom const& rom : SyntheticRoms()) {
+    Chip8 simple(1);
+    simple.LoadROM(rom.code.data(), rom.code.size());
+    Chip8 vip(1);
+    vip.LoadROM(rom.code.data(), rom.code.size());
+
+    uint64_t vipInstructions = 0;
+    BenchmarkResult accurate = RunBenchmark("vip", 0, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        vipInstructions += vip.RunVipFrame(false);
+      }
+    });
+    accurate.operations = vipInstructions;
+
+    unsigned int perFrame = static_cast<unsigned int>(vipInstructions / frames);
+    BenchmarkResult fixed = RunBenchmark("fixed", perFrame * frames, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        simple.RunFrame(perFrame);
+      }
+    });
+
+    fixed.name = std::string("timing fixed ") + rom.name;
+    accurate.name = std::string("timing vip ") + rom.name;
+    results.push_back(fixed);
+    results.push_back(accurate);
+  }
+  return results;
+}
+
+/**
+ * Single-threaded executor for frontend work written as C++20
+ * coroutines. Suspended coroutines wait in a queue ordered by deadline
+ * (ties in scheduling order); Run() sleeps on the clock until the
+ * earliest one is due and resumes it. No threads, no locks: subsystems
+ * interleave only at their co_await points.
+ */
+class FrontendExecutor {
+  public:
+    struct Task {
+      struct promise_type {
+        Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+      };
+
+      std::coroutine_handle<promise_type> handle;
+    };
+
+    //co_await-able: resumes the coroutine once the clock reaches the deadline
+    struct Wake {
+      FrontendExecutor& executor;
+      Clock::Duration deadline;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { executor.Schedule(handle, deadline); }
+      void await_resume() const noexcept {}
+    };
+
+    explicit FrontendExecutor(Clock& clock) : clock(clock), sequence(0), stopped(false) {}
+
+    ~FrontendExecutor() {
+      for (std::coroutine_handle<> handle : tasks) {
+        handle.destroy();
+      }
+    }
+
+    Clock& GetClock() {
+      return clock;
+    }
+
+    //Takes ownership of a task and schedules its first step now
+    void Spawn(Task task) {
+      tasks.push_back(task.handle);
+      Schedule(task.handle, clock.Now());
+    }
+
+    Wake SleepUntil(Clock::Duration deadline) {
+      return Wake{*this, deadline};
+    }
+
+    //Lets every other task that is already due run first
+    Wake Yield() {
+      return Wake{*this, clock.Now()};
+    }
+
+    void Stop() {
+      stopped = true;
+    }
+
+    //Runs until Stop() is called or no task is waiting
+    void Run() {
+      while (!stopped && !queue.empty()) {
+        Entry next = queue.top();
+        queue.pop();
+        clock.SleepUntil(next.deadline);
+        next.handle.resume();
+      }
+    }
+
+  private:
+    struct Entry {
+      Clock::Duration deadline;
+      uint64_t sequence;
+      std::coroutine_handle<> handle;
+
+      bool operator>(Entry const& other) const {
+        return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+      }
+    };
+
+    void Schedule(std::coroutine_handle<> handle, Clock::Duration deadline) {
+      queue.push(Entry{deadline, sequence++, handle});
+    }
+
+    Clock& clock;
+    uint64_t sequence;
+    bool stopped;
+    std::vector<std::coroutine_handle<>> tasks;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+};
+
+//Frame start for a 60 Hz frame counted from `start`
+Clock::Duration FrameStart(Clock::Duration start, uint64_t frame) {
+  return start + Clock::Duration(static_cast<Clock::Duration::rep>(frame * 1000000000ull / TIMER_HZ));
+}
+
+/**
+ * A coroutine that runs `work` once per 60 Hz frame, for `frames`
+ * frames (0 = forever). Tasks spawned in the same order keep that
+ * order within every frame.
+ */
+FrontendExecutor::Task FrameTask(FrontendExecutor& executor, Clock::Duration start, uint64_t frames, std::function<void()> work) {
+  for (uint64_t frame = 0; frames == 0 || frame < frames; ++frame) {
+    co_await executor.SleepUntil(FrameStart(start, frame));
+    work();
+  }
+}
+
+/**
+ * The interactive frontend as five coroutines on one FrontendExecutor:
+ * poll input, emulate a frame, feed audio, present and record. Each
+ * wakes once per 60 Hz frame, in that order. Platform and recorder are
+ * optional, so the same frontend runs headless. With metrics attached,
+ * each coroutine's CPU time goes to its own cpu.* counter.
+ */
+class CoroutineFrontend {
+  public:
+    CoroutineFrontend(Chip8& chip8, Clock& clock, unsigned int cyclesPerFrame)
+      : chip8(chip8), clock(clock), cyclesPerFrame(cyclesPerFrame), platform(nullptr), videoPitch(0),
+        recorder(nullptr), frames(0), cpu{} {}
+
+    void SetPlatform(Platform* frontend, int pitch) {
+      platform = frontend;
+      videoPitch = pitch;
+    }
+
+    void SetRecorder(DatasetWriter* writer) {
+      recorder = writer;
+    }
+
+    //Receives the buzzer state once per frame
+    void SetAudio(std::function<void(bool)> feed) {
+      audio = feed;
+    }
+
+    //Charges emulation to cpu.emulation.ns and input, audio, present and record to cpu.frontend.<name>.ns
+    void SetMetrics(MetricsRegistry& metrics) {
+      char const* const names[] = {"cpu.frontend.input.ns", "cpu.emulation.ns", "cpu.frontend.audio.ns",
+                                   "cpu.frontend.present.ns", "cpu.frontend.record.ns"};
+      for (unsigned int task = 0; task < FRONTEND_TASKS; ++task) {
+        cpu[task] = &metrics.Counter(names[task]);
+      }
+      CpuMeter::NanosecondsPerTick();
+    }
+
+    //Runs until the platform asks to quit or, if non-zero, the frame limit is reached
+    void Run(uint64_t limit = 0) {
+      FrontendExecutor executor(clock);
+      Clock::Duration start = clock.Now();
+
+      executor.Spawn(FrameTask(executor, start, limit, Metered(TASK_INPUT, [this, &executor] {
+        if (platform && platform->ProcessInput(chip8.keypad)) {
+          executor.Stop();
+        }
+      })));
+      executor.Spawn(FrameTask(executor, start, limit, Metered(TASK_EMULATE, [this] {
+        chip8.RunFrame(cyclesPerFrame);
+        ++frames;
+      })));
+      executor.Spawn(FrameTask(executor, start, limit, Metered(TASK_AUDIO, [this] {
+        if (audio) audio(chip8.soundTimer > 0);
+      })));
+      executor.Spawn(FrameTask(executor, start, limit, Metered(TASK_PRESENT, [this] {
+        if (platform) platform->Update(chip8.video, videoPitch);
+      })));
+      executor.Spawn(FrameTask(executor, start, limit, Metered(TASK_RECORD, [this] {
+        if (recorder) recorder->Append(chip8.video, chip8.keypad, &chip8.memory);
+      })));
+      executor.Run();
+    }
+
+    uint64_t FrameCount() const {
+      return frames;
+    }
+
+  private:
+    enum FrontendTask { TASK_INPUT, TASK_EMULATE, TASK_AUDIO, TASK_PRESENT, TASK_RECORD, FRONTEND_TASKS };
+
+    //Wraps work so its CPU time is charged, if metrics are attached
+    std::function<void()> Metered(FrontendTask task, std::function<void()> work) {
+      std::atomic<uint64_t>* account = cpu[task];
+      if (!account) {
+        return work;
+      }
+      return [account, work] {
+        uint64_t start = CpuMeter::Now();
+        work();
+        CpuMeter::Charge(*account, start);
+      };
+    }
+
+    Chip8& chip8;
+    Clock& clock;
+    unsigned int cyclesPerFrame;
+    Platform* platform;
+    int videoPitch;
+    DatasetWriter* recorder;
+    std::function<void(bool)> audio;
+    uint64_t frames;
+    std::atomic<uint64_t>* cpu[FRONTEND_TASKS];
+};
+
+//CPU time consumed by all threads of this process
+Clock::Duration ProcessCpuTime() {
+  timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec);
+}
+
+/**
+ * Process CPU time of the same four subsystems (emulate, audio, a frame
+ * hash standing in for present, packing standing in for recording)
+ * run as coroutines on one executor and as one thread per subsystem
+ * synchronised per frame. Both are paced in real time on a clock sped
+ * up by `speedup`. Operations are frames, so the rate is frames per
+ * CPU-second: higher means less CPU per frame.
+ */
+std::vector<BenchmarkResult> BenchmarkFrontendExecutors(uint64_t frames = 240, double speedup = 4.0, unsigned int cyclesPerFrame = 10) {
+  std::vector<SyntheticRom> roms = SyntheticRoms();
+  SyntheticRom const& rom = roms[3];
+  std::vector<BenchmarkResult> results;
+  RealClock real;
+  volatile uint64_t sink = 0;
+  uint8_t packed[PACKED_FRAME_SIZE];
+
+  {
+    ScaledClock clock(real, speedup);
+    Chip8 chip8(1);
+    chip8.LoadROM(rom.code.data(), rom.code.size());
+    Clock::Duration cpu = ProcessCpuTime();
+    FrontendExecutor executor(clock);
+    Clock::Duration start = clock.Now();
+    executor.Spawn(FrameTask(executor, start, frames, [&] { chip8.RunFrame(cyclesPerFrame); }));
+    executor.Spawn(FrameTask(executor, start, frames, [&] { sink = sink + (chip8.soundTimer > 0); }));
+    executor.Spawn(FrameTask(executor, start, frames, [&] { sink = sink + FrameHash(chip8.video); }));
+    executor.Spawn(FrameTask(executor, start, frames, [&] { PackFrame(chip8.video, packed); sink = sink + packed[0]; }));
+    executor.Run();
+    results.push_back(BenchmarkResult{"frontend coroutines", frames, std::chrono::duration<double>(ProcessCpuTime() - cpu).count()});
+  }
+
+  {
+    ScaledClock clock(real, speedup);
+    Chip8 chip8(1);
+    chip8.LoadROM(rom.code.data(), rom.code.size());
+    std::mutex mutex;
+    std::condition_variable emulated;
+    uint64_t done = 0;
+    Clock::Duration cpu = ProcessCpuTime();
+    Clock::Duration start = clock.Now();
+
+    std::thread emulator([&] {
+      for (uint64_t frame = 0; frame < frames; ++frame) {
+        clock.SleepUntil(FrameStart(start, frame));
+        std::lock_guard<std::mutex> lock(mutex);
+        chip8.RunFrame(cyclesPerFrame);
+        done = frame + 1;
+        emulated.notify_all();
+      }
+    });
+    //Each subsystem waits for its frame to be emulated, then works on it under the lock
+    auto subsystem = [&](std::function<void()> work) {
+      return std::thread([&, work] {
+        for (uint64_t frame = 0; frame < frames; ++frame) {
+          std::unique_lock<std::mutex> lock(mutex);
+          emulated.wait(lock, [&] { return done > frame; });
+          work();
+        }
+      });
+    };
+    std::thread audio = subsystem([&] { sink = sink + (chip8.soundTimer > 0); });
+    std::thread present = subsystem([&] { sink = sink + FrameHash(chip8.video); });
+    std::thread record = subsystem([&] { PackFrame(chip8.video, packed); sink = sink + packed[0]; });
+    emulator.join();
+    audio.join();
+    present.join();
+    record.join();
+    results.push_back(BenchmarkResult{"frontend threads", frames, std::chrono::duration<double>(ProcessCpuTime() - cpu).count()});
+  }
+  return results;
+}
+
+/**
+ * Cost of CPU accounting: the same batch slices (of the mixed ROM) run
+ * bare and with a CpuMeter charge around each one, at two slice sizes.
+ * Operations are slices; the difference in time per slice is the
+ * accounting overhead.
+ */
+std::vector<BenchmarkResult> BenchmarkCpuAccounting(uint64_t slices = 200000) {
+  std::vector<SyntheticRom> roms = SyntheticRoms();
+  SyntheticRom const& rom = roms[3];
+  std::vector<BenchmarkResult> results;
+  MetricsRegistry metrics;
+  std::atomic<uint64_t>& account = metrics.Counter("cpu.session.bench.ns");
+  CpuMeter::NanosecondsPerTick();
+
+  for (unsigned int slice : {10u, 100u}) {
+    Chip8 bare(1);
+    bare.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(RunBenchmark("cpu accounting off, slice " + std::to_string(slice), slices, [&] {
+      for (uint64_t s = 0; s < slices; ++s) {
+        for (unsigned int i = 0; i < slice; ++i) {
+          bare.Cycle();
+        }
+      }
+    }));
+
+    Chip8 metered(1);
+    metered.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(RunBenchmark("cpu accounting on, slice " + std::to_string(slice), slices, [&] {
+      for (uint64_t s = 0; s < slices; ++s) {
+        uint64_t tick = CpuMeter::Now();
+        for (unsigned int i = 0; i < slice; ++i) {
+          metered.Cycle();
+        }
+        CpuMeter::Charge(account, tick);
+      }
+    }));
+  }
+  return results;
+}
+
+/**
+ * Execution trace: a TraceHeader followed by one fixed-size TraceRecord
+ * per executed instruction, so record n is cycle n and the file can be
+ * read in place through a mapping. Each record holds the instruction
+ * and the register state after it ran, plus the range of memory it
+ * wrote.
+ */
+const uint32_t TRACE_MAGIC = 0x52543843; // "C8TR"
+const uint32_t TRACE_INDEX_MAGIC = 0x58493843; // "C8IX"
+const uint32_t TRACE_VERSION = 1;
+
+struct TraceHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+
+struct TraceRecord {
+  uint16_t pc;           // address the instruction was fetched from
+  uint16_t opcode;
+  uint16_t index;        // I after the instruction
+  uint16_t writeAddress; // first byte written, if writeCount > 0
+  uint8_t registers[16]; // V0-VF after the instruction
+  uint8_t sp;
+  uint8_t delayTimer;
+  uint8_t soundTimer;
+  uint8_t writeCount;    // bytes written to memory (Fx33, Fx55)
+  uint8_t reserved[4];
+};
+
+/**
+ * Writes an execution trace while stepping a Chip8. If the file cannot
+ * be created, or any write fails, the writer stays failed: Step() still
+ * runs the instruction but its record is dropped, and Flush() and
+ * Close() return false.
+ */
+class TraceWriter {
+  public:
+    explicit TraceWriter(char const* filename) : file(filename, std::ios::binary | std::ios::trunc), count(0), failed(false) {
+      TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), 0};
+      file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+      failed = !file;
+      buffer.reserve(BUFFER_RECORDS);
+    }
+
+    ~TraceWriter() {
+      Close();
+    }
+
+    bool IsOpen() const {
+      return file.is_open();
+    }
+
+    //Executes one instruction and records it
+    void Step(Chip8& chip8) {
+      TraceRecord record = {};
+      record.pc = chip8.pc;
+      uint16_t next = chip8.memory.Word(chip8.pc & ADDRESS_MASK);
+      if ((next & 0xF0FFu) == 0xF033u) {
+        record.writeAddress = chip8.index;
+        record.writeCount = 3;
+      } else if ((next & 0xF0FFu) == 0xF055u) {
+        record.writeAddress = chip8.index;
+        record.writeCount = ((next & 0x0F00u) >> 8u) + 1;
+      }
+
+      chip8.Cycle();
+
+      record.opcode = chip8.opcode;
+      record.index = chip8.index;
+      memcpy(record.registers, chip8.registers, sizeof(record.registers));
+      record.sp = chip8.sp;
+      record.delayTimer = chip8.delayTimer;
+      record.soundTimer = chip8.soundTimer;
+      buffer.push_back(record);
+      ++count;
+      if (buffer.size() == BUFFER_RECORDS) {
+        Flush();
+      }
+    }
+
+    //Writes the buffered records; false if this or any earlier write failed
+    bool Flush() {
+      if (!failed) {
+        file.write(reinterpret_cast<char const*>(buffer.data()), buffer.size() * sizeof(TraceRecord));
+        file.flush();
+        failed = !file;
+      }
+      buffer.clear();
+      return !failed;
+    }
+
+    //Flushes and closes the file; false if any record failed to reach it
+    bool Close() {
+      if (file.is_open()) {
+        Flush();
+        file.close();
+        failed = failed || !file;
+      }
+      return !failed;
+    }
+
+    uint64_t RecordCount() const {
+      return count;
+    }
+
+  private:
+    static const size_t BUFFER_RECORDS = 4096;
+
+    std::ofstream file;
+    std::vector<TraceRecord> buffer;
+    uint64_t count;
+    bool failed;
+};
+
+/**
+ * Read-only mapping of a whole file.
+ */
+class MappedFile {
+  public:
+    MappedFile() : base(nullptr), size(0) {}
+
+    ~MappedFile() {
+      if (base) {
+        munmap(const_cast<uint8_t*>(base), size);
+      }
+    }
+
+    bool Open(char const* filename) {
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat info;
+      if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+      }
+      void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (mapping == MAP_FAILED) {
+        return false;
+      }
+      base = static_cast<uint8_t const*>(mapping);
+      size = info.st_size;
+      return true;
+    }
+
+    uint8_t const* Data() const { return base; }
+    size_t Size() const { return size; }
+
+  private:
+    uint8_t const* base;
+    size_t size;
+};
+
+/**
+ * Sidecar index of a trace, as sorted cycle lists grouped by key. Each
+ * section is a table of key offsets followed by the cycles themselves
+ * (compressed sparse rows), all uint64_t:
+ *
+ *   register values: key = register * 256 + value, cycles where Vx became value
+ *   I changes:       one key, cycles where I changed
+ *   pc:              key = address, cycles that executed it
+ *   writes:          key = address, cycles that wrote it
+ */
+enum TraceIndexSection {
+  TRACE_REGISTER_VALUES,
+  TRACE_INDEX_CHANGES,
+  TRACE_PC,
+  TRACE_WRITES,
+  TRACE_SECTIONS
+};
+
+const uint64_t TRACE_SECTION_KEYS[TRACE_SECTIONS] = {16 * 256, 1, 4096, 4096};
+
+struct TraceIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t recordCount;
+  uint64_t sectionOffsets[TRACE_SECTIONS]; // byte offset of each section's key offsets
+};
+
+/**
+ * Builds the sidecar index with passes over the mapped trace: one to
+ * count entries per key, then the records again in chunks of
+ * TRACE_INDEX_CHUNK, each sorted by key in memory and written straight
+ * to every key's slot in the file. Memory use is one chunk plus the key
+ * offset tables, however long the trace. Cycles come out sorted because
+ * the trace is scanned in order.
+ */
+const uint64_t TRACE_INDEX_CHUNK = 65536; // records per chunk
+
+bool BuildTraceIndex(char const* traceFile, char const* indexFile) {
+  MappedFile trace;
+  if (!trace.Open(traceFile) || trace.Size() < sizeof(TraceHeader)) {
+    return false;
+  }
+  TraceHeader const* header = reinterpret_cast<TraceHeader const*>(trace.Data());
+  if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->recordSize != sizeof(TraceRecord)) {
+    return false;
+  }
+  TraceRecord const* records = reinterpret_cast<TraceRecord const*>(trace.Data() + sizeof(TraceHeader));
+  uint64_t recordCount = (trace.Size() - sizeof(TraceHeader)) / sizeof(TraceRecord);
+
+  //Calls emit(section, key, cycle) for every index entry of the records in [from, to)
+  auto scan = [&](uint64_t from, uint64_t to, auto emit) {
+    uint8_t registers[16] = {};
+    uint16_t index = 0;
+    if (from > 0) {
+      memcpy(registers, records[from - 1].registers, sizeof(registers));
+      index = records[from - 1].index;
+    }
+    for (uint64_t cycle = from; cycle < to; ++cycle) {
+      TraceRecord const& record = records[cycle];
+      for (unsigned int reg = 0; reg < 16; ++reg) {
+        if (record.registers[reg] != registers[reg] || cycle == 0) {
+          emit(TRACE_REGISTER_VALUES, reg * 256u + record.registers[reg], cycle);
+        }
+      }
+      if (record.index != index || cycle == 0) {
+        emit(TRACE_INDEX_CHANGES, 0, cycle);
+      }
+      emit(TRACE_PC, record.pc & 0xFFFu, cycle);
+      for (unsigned int i = 0; i < record.writeCount; ++i) {
+        emit(TRACE_WRITES, (record.writeAddress + i) & 0xFFFu, cycle);
+      }
+      memcpy(registers, record.registers, sizeof(registers));
+      index = record.index;
+    }
+  };
+
+  //Key offsets for the whole trace, and where each section starts in the file
+  std::vector<uint64_t> offsets[TRACE_SECTIONS];
+  for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+    offsets[section].assign(TRACE_SECTION_KEYS[section] + 1, 0);
+  }
+  scan(0, recordCount, [&](unsigned int section, uint64_t key, uint64_t) { ++offsets[section][key + 1]; });
+
+  TraceIndexHeader indexHeader = {TRACE_INDEX_MAGIC, TRACE_VERSION, recordCount, {}};
+  uint64_t position = sizeof(TraceIndexHeader);
+  std::vector<uint64_t> fill[TRACE_SECTIONS]; // next free cycle slot per key
+  for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+    for (uint64_t key = 0; key < TRACE_SECTION_KEYS[section]; ++key) {
+      offsets[section][key + 1] += offsets[section][key];
+    }
+    fill[section].assign(offsets[section].begin(), offsets[section].end() - 1);
+    indexHeader.sectionOffsets[section] = position;
+    position += (offsets[section].size() + offsets[section].back()) * sizeof(uint64_t);
+  }
+
+  int fd = open(indexFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  auto put = [&](uint64_t at, void const* data, size_t size) {
+    uint8_t const* bytes = static_cast<uint8_t const*>(data);
+    while (ok && size) {
+      ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(at));
+      ok = written > 0;
+      bytes += written;
+      at += written;
+      size -= written;
+    }
+  };
+  put(0, &indexHeader, sizeof(indexHeader));
+  for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+    put(indexHeader.sectionOffsets[section], offsets[section].data(), offsets[section].size() * sizeof(uint64_t));
+  }
+
+  //Each chunk: count per key, sort the chunk's entries by key, then write every key's run to its slot
+  std::vector<uint64_t> chunkOffsets[TRACE_SECTIONS];
+  std::vector<uint64_t> chunkCycles[TRACE_SECTIONS];
+  for (uint64_t from = 0; ok && from < recordCount; from += TRACE_INDEX_CHUNK) {
+    uint64_t to = std::min(recordCount, from + TRACE_INDEX_CHUNK);
+    for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+      chunkOffsets[section].assign(TRACE_SECTION_KEYS[section] + 1, 0);
+    }
+    scan(from, to, [&](unsigned int section, uint64_t key, uint64_t) { ++chunkOffsets[section][key + 1]; });
+    for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+      for (uint64_t key = 0; key < TRACE_SECTION_KEYS[section]; ++key) {
+        chunkOffsets[section][key + 1] += chunkOffsets[section][key];
+      }
+      chunkCycles[section].resize(chunkOffsets[section].back());
+    }
+    scan(from, to, [&](unsigned int section, uint64_t key, uint64_t cycle) {
+      chunkCycles[section][chunkOffsets[section][key]++] = cycle;
+    });
+
+    //chunkOffsets[key] now points at the end of the key's run
+    for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+      uint64_t cyclesAt = indexHeader.sectionOffsets[section] + offsets[section].size() * sizeof(uint64_t);
+      uint64_t runStart = 0;
+      for (uint64_t key = 0; key < TRACE_SECTION_KEYS[section]; ++key) {
+        uint64_t runEnd = chunkOffsets[section][key];
+        if (runEnd > runStart) {
+          put(cyclesAt + fill[section][key] * sizeof(uint64_t), &chunkCycles[section][runStart], (runEnd - runStart) * sizeof(uint64_t));
+          fill[section][key] += runEnd - runStart;
+        }
+        runStart = runEnd;
+      }
+    }
+  }
+  ok = ok && ftruncate(fd, static_cast<off_t>(position)) == 0;
+  return close(fd) == 0 && ok;
+}
+
+/**
+ * Queries over a trace and its sidecar index, both memory-mapped.
+ * Lookups are binary searches in the index; the trace itself is only
+ * touched to fetch the records that were asked for.
+ */
+class TraceQuery {
+  public:
+    //Sorted cycle numbers, pointing into the mapped index
+    struct Cycles {
+      uint64_t const* begin;
+      uint64_t const* end;
+
+      size_t Size() const { return end - begin; }
+    };
+
+    TraceQuery() : header(nullptr), records(nullptr), recordCount(0) {}
+
+    bool Open(char const* traceFile, char const* indexFile) {
+      if (!trace.Open(traceFile) || !index.Open(indexFile) || trace.Size() < sizeof(TraceHeader) || index.Size() < sizeof(TraceIndexHeader)) {
+        return false;
+      }
+      TraceHeader const* traceHeader = reinterpret_cast<TraceHeader const*>(trace.Data());
+      header = reinterpret_cast<TraceIndexHeader const*>(index.Data());
+      if (traceHeader->magic != TRACE_MAGIC || traceHeader->version != TRACE_VERSION || traceHeader->recordSize != sizeof(TraceRecord)
+          || header->magic != TRACE_INDEX_MAGIC || header->version != TRACE_VERSION) {
+        return false;
+      }
+      records = reinterpret_cast<TraceRecord const*>(trace.Data() + sizeof(TraceHeader));
+      recordCount = (trace.Size() - sizeof(TraceHeader)) / sizeof(TraceRecord);
+      return recordCount == header->recordCount && SectionsInBounds();
+    }
+
+    uint64_t RecordCount() const {
+      return recordCount;
+    }
+
+    TraceRecord const& Record(uint64_t cycle) const {
+      return records[cycle];
+    }
+
+    //Last cycle before `before` at which Vreg changed to `value`, or -1
+    int64_t LastBecame(unsigned int reg, uint8_t value, uint64_t before) const {
+      return Last(List(TRACE_REGISTER_VALUES, (reg & 0xFu) * 256u + value), before);
+    }
+
+    //Value of Vreg after the given cycle
+    uint8_t RegisterAt(unsigned int reg, uint64_t cycle) const {
+      return records[cycle].registers[reg & 0xFu];
+    }
+
+    //Cycles at which I changed
+    Cycles IndexChanges() const {
+      return List(TRACE_INDEX_CHANGES, 0);
+    }
+
+    //Every cycle that executed the instruction at an address
+    Cycles Executions(uint16_t pc) const {
+      return List(TRACE_PC, pc & 0xFFFu);
+    }
+
+    //Every cycle that wrote to an address
+    Cycles WritesTo(uint16_t address) const {
+      return List(TRACE_WRITES, address & 0xFFFu);
+    }
+
+    //Narrows a cycle list to [from, to)
+    static Cycles Between(Cycles cycles, uint64_t from, uint64_t to) {
+      return Cycles{std::lower_bound(cycles.begin, cycles.end, from), std::lower_bound(cycles.begin, cycles.end, to)};
+    }
+
+  private:
+    //Every section's key table and cycle lists lie inside the mapped index, so List() never reads past it
+    bool SectionsInBounds() const {
+      size_t words = index.Size() / sizeof(uint64_t);
+      for (unsigned int section = 0; section < TRACE_SECTIONS; ++section) {
+        uint64_t start = header->sectionOffsets[section];
+        uint64_t keys = TRACE_SECTION_KEYS[section];
+        if (start % sizeof(uint64_t) != 0 || start / sizeof(uint64_t) > words || words - start / sizeof(uint64_t) < keys + 1) {
+          return false;
+        }
+        uint64_t const* offsets = reinterpret_cast<uint64_t const*>(index.Data() + start);
+        uint64_t room = words - start / sizeof(uint64_t) - (keys + 1);
+        for (uint64_t key = 0; key < keys; ++key) {
+          if (offsets[key] > offsets[key + 1]) {
+            return false;
+          }
+        }
+        if (offsets[0] != 0 || offsets[keys] > room) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    Cycles List(TraceIndexSection section, uint64_t key) const {
+      uint64_t const* offsets = reinterpret_cast<uint64_t const*>(index.Data() + header->sectionOffsets[section]);
+      uint64_t const* cycles = offsets + TRACE_SECTION_KEYS[section] + 1;
+      return Cycles{cycles + offsets[key], cycles + offsets[key + 1]};
+    }
+
+    static int64_t Last(Cycles cycles, uint64_t before) {
+      uint64_t const* position = std::lower_bound(cycles.begin, cycles.end, before);
+      return position == cycles.begin ? -1 : static_cast<int64_t>(*(position - 1));
+    }
+
+    MappedFile trace;
+    MappedFile index;
+    TraceIndexHeader const* header;
+    TraceRecord const* records;
+    uint64_t recordCount;
+};
+
+//FNV-1a hash of the machine state other than the video and keypad, including the RNG and VIP cycle carry
+uint64_t StateHash(Chip8 const& chip8) {
+  uint64_t hash = Fnv1a(FNV_OFFSET_BASIS, chip8.registers, sizeof(chip8.registers));
+  for (unsigned int page = 0; page < MEMORY_PAGES; ++page) {
+    hash = Fnv1a(hash, chip8.memory.Page(page), MEMORY_PAGE_SIZE);
+  }
+  hash = Fnv1a(hash, &chip8.index, sizeof(chip8.index));
+  hash = Fnv1a(hash, &chip8.pc, sizeof(chip8.pc));
+  hash = Fnv1a(hash, chip8.stack, sizeof(chip8.stack));
+  hash = Fnv1a(hash, &chip8.sp, sizeof(chip8.sp));
+  hash = Fnv1a(hash, &chip8.delayTimer, sizeof(chip8.delayTimer));
+  hash = Fnv1a(hash, &chip8.soundTimer, sizeof(chip8.soundTimer));
+  hash = Fnv1a(hash, &chip8.cycleCarry, sizeof(chip8.cycleCarry));
+  //The same textual form Chip8State keeps, so a restored machine hashes alike
+  std::ostringstream rng;
+  rng << chip8.randGen;
+  std::string text = rng.str();
+  return Fnv1a(hash, text.data(), text.size());
+}
+
+/**
+ * Replay file: a ReplayHeader, the ROM, then one ReplayFrame per frame
+ * with the keypad held during the frame and the hashes of the state at
+ * its end. cyclesPerFrame 0 means the run used VIP timing.
+ */
+const uint32_t REPLAY_MAGIC = 0x50523843; // "C8RP"
+const uint32_t REPLAY_VERSION = 2; // 2: state hashes cover the RNG and cycle carry
+
+struct ReplayHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seed;
+  uint32_t cyclesPerFrame;
+  uint32_t romSize;
+  uint32_t reserved;
+  uint64_t frameCount;
+};
+
+struct ReplayFrame {
+  uint64_t stateHash;
+  uint64_t videoHash;
+  uint16_t keys;
+  uint8_t reserved[6];
+};
+
+struct Replay {
+  uint32_t seed;
+  uint32_t cyclesPerFrame;
+  std::vector<uint8_t> rom;
+  std::vector<ReplayFrame> frames;
+
+  bool Load(char const* filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    std::streamoff size = file.tellg();
+    ReplayHeader header;
+    if (size < static_cast<std::streamoff>(sizeof(header)) || !file.seekg(0)
+        || !file.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || header.magic != REPLAY_MAGIC || header.version != REPLAY_VERSION) {
+      return false;
+    }
+    //Sizes come from the file; check them against what is actually there before allocating
+    uint64_t remaining = static_cast<uint64_t>(size) - sizeof(header);
+    if (header.romSize > MEMORY_SIZE - START_ADDRESS || header.romSize > remaining
+        || header.frameCount != (remaining - header.romSize) / sizeof(ReplayFrame)) {
+      return false;
+    }
+    seed = header.seed;
+    cyclesPerFrame = header.cyclesPerFrame;
+    rom.resize(header.romSize);
+    frames.resize(header.frameCount);
+    file.read(reinterpret_cast<char*>(rom.data()), rom.size());
+    file.read(reinterpret_cast<char*>(frames.data()), frames.size() * sizeof(ReplayFrame));
+    return file.good();
+  }
+
+  bool Save(char const* filename) const {
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    ReplayHeader header = {REPLAY_MAGIC, REPLAY_VERSION, seed, cyclesPerFrame,
+                           static_cast<uint32_t>(rom.size()), 0, frames.size()};
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    file.write(reinterpret_cast<char const*>(rom.data()), rom.size());
+    file.write(reinterpret_cast<char const*>(frames.data()), frames.size() * sizeof(ReplayFrame));
+    return file.good();
+  }
+
+  //Appends the frame that just ran on chip8
+  void Record(Chip8 const& chip8) {
+    ReplayFrame frame = {StateHash(chip8), FrameHash(chip8.video), KeypadMask(chip8.keypad), {}};
+    frames.push_back(frame);
+  }
+};
+
+struct ReplayResult {
+  std::string name;
+  uint64_t frames;     // frames replayed, up to and including a divergence
+  int64_t divergedAt;  // first frame whose hashes differ, or -1
+  std::string report;  // what differed, or why the replay could not run
+  bool Passed() const {
+    return divergedAt < 0 && report.empty();
+  }
+};
+
+//Replays headless, stopping at the first frame whose hashes differ from the recording
+ReplayResult VerifyReplay(std::string const& name, Replay const& replay) {
+  ReplayResult result = {name, 0, -1, std::string()};
+  Chip8 chip8(replay.seed);
+  chip8.LoadROM(replay.rom.data(), replay.rom.size());
+  for (ReplayFrame const& expected : replay.frames) {
+    ApplyKeypadMask(expected.keys, chip8.keypad);
+    if (replay.cyclesPerFrame) {
+      chip8.RunFrame(replay.cyclesPerFrame);
+    } else {
+      chip8.RunVipFrame();
+    }
+    ++result.frames;
+
+    uint64_t stateHash = StateHash(chip8);
+    uint64_t videoHash = FrameHash(chip8.video);
+    if (stateHash != expected.stateHash || videoHash != expected.videoHash) {
+      result.divergedAt = static_cast<int64_t>(result.frames - 1);
+      std::ostringstream report;
+      report << std::hex << "frame " << std::dec << result.divergedAt << std::hex
+             << ": state " << (stateHash == expected.stateHash ? "matches" : "differs")
+             << " (expected " << expected.stateHash << ", got " << stateHash << ")"
+             << ", video " << (videoHash == expected.videoHash ? "matches" : "differs")
+             << "; pc=" << chip8.pc << " op=" << chip8.opcode << " I=" << chip8.index
+             << " sp=" << static_cast<unsigned int>(chip8.sp) << " V=";
+      for (unsigned int reg = 0; reg < 16; ++reg) {
+        report << (reg ? "," : "") << static_cast<unsigned int>(chip8.registers[reg]);
+      }
+      result.report = report.str();
+      break;
+    }
+  }
+  return result;
+}
+
+/**
+ * Verifies an archive of replay files on every core. Workers pull the
+ * next file from a shared counter and load it themselves, so long and
+ * short replays balance out and only one replay per worker is resident.
+ */
+class ReplayFarm {
+  public:
+    explicit ReplayFarm(unsigned int workers)
+      : workers(workers ? workers : std::max(1u, std::thread::hardware_concurrency())) {}
+
+    void Add(std::string const& filename) {
+      filenames.push_back(filename);
+    }
+
+    size_t Size() const {
+      return filenames.size();
+    }
+
+    //Verifies every replay; results are in the order the files were added
+    std::vector<ReplayResult> Run() {
+      std::vector<ReplayResult> results(filenames.size());
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> threads;
+      RealClock clock;
+      Clock::Duration start = clock.Now();
+      for (unsigned int w = 0; w < workers; ++w) {
+        threads.emplace_back([this, &results, &next] {
+          Replay replay;
+          for (size_t i = next++; i < filenames.size(); i = next++) {
+            if (replay.Load(filenames[i].c_str())) {
+              results[i] = VerifyReplay(filenames[i], replay);
+            } else {
+              results[i] = ReplayResult{filenames[i], 0, -1, "unreadable replay"};
+            }
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      elapsed = clock.Now() - start;
+      return results;
+    }
+
+    //Replays per second over the last Run()
+    double Rate() const {
+      double seconds = std::chrono::duration<double>(elapsed).count();
+      return seconds > 0 ? filenames.size() / seconds : 0;
+    }
+
+    static size_t Print(std::vector<ReplayResult> const& results) {
+      size_t failures = 0;
+      for (ReplayResult const& result : results) {
+        if (!result.Passed()) {
+          printf("FAIL %s: %s\n", result.name.c_str(), result.report.c_str());
+          ++failures;
+        }
+      }
+      printf("%zu replays, %zu passed, %zu failed\n", results.size(), results.size() - failures, failures);
+      return failures;
+    }
+
+  private:
+    unsigned int workers;
+    std::vector<std::string> filenames;
+    Clock::Duration elapsed{};
+};
+
+/**
+ * Ways the next instruction would stray outside the machine. The
+ * interpreter masks every such access (memory, video rows, stack and
+ * keys all wrap), so apart from an opcode with no handler they are all
+ * defined behaviour; a ROM leaning on them is merely suspicious, often
+ * written for another interpreter. The compatibility scanner checks
+ * each instruction before it runs, stops the ROM at an unhandled
+ * opcode and records the others as warnings.
+ */
+enum ScanFault {
+  FAULT_NONE,
+  FAULT_FETCH,    // pc runs off the end of memory
+  FAULT_OPCODE,   // opcode has no handler
+  FAULT_MEMORY,   // I-relative access past the end of memory (Dxyn, Fx33, Fx55, Fx65)
+  FAULT_VIDEO,    // sprite rows past the bottom of the video buffer
+  FAULT_STACK,    // CALL with a full stack or RET with an empty one
+  FAULT_KEY       // key index above 0xF in Ex9E/ExA1
+};
+
+char const* ScanFaultName(ScanFault fault) {
+  static char const* const names[] = {"none", "fetch", "opcode", "memory", "video", "stack", "key"};
+  return names[fault];
+}
+
+//Checks what the next Cycle() would touch, without running it
+ScanFault CheckNextInstruction(Chip8 const& chip8) {
+  if (chip8.pc >= MEMORY_SIZE - 1) {
+    return FAULT_FETCH;
+  }
+  uint16_t op = (chip8.memory[chip8.pc] << 8u) | chip8.memory[chip8.pc + 1];
+  uint8_t x = (op & 0x0F00u) >> 8u;
+  uint8_t low = op & 0x000Fu;
+  uint8_t kk = op & 0x00FFu;
+  size_t end = MEMORY_SIZE;
+
+  switch (op >> 12u) {
+    case 0x0:
+      if (Chip8::table0[low] == &Chip8::OP_0nnn && !IsHostCall(op)) {
+        return FAULT_OPCODE;
+      }
+      //table0 dispatches on the low nibble alone, so every 0nnE returns
+      if (Chip8::table0[low] == &Chip8::OP_00EE && chip8.sp == 0) {
+        return FAULT_STACK;
+      }
+      return FAULT_NONE;
+    case 0x2:
+      return chip8.sp >= sizeof(chip8.stack) / sizeof(chip8.stack[0]) ? FAULT_STACK : FAULT_NONE;
+    case 0x8:
+      return Chip8::table8[low] == &Chip8::OP_NULL ? FAULT_OPCODE : FAULT_NONE;
+    case 0xD: {
+      if (chip8.index + low > end) {
+        return FAULT_MEMORY;
+      }
+      //Sprites moving off the side are normal; rows wrapping from the bottom are not
+      unsigned int yPos = chip8.registers[(op & 0x00F0u) >> 4u] % VIDEO_HEIGHT;
+      return yPos + low > VIDEO_HEIGHT ? FAULT_VIDEO : FAULT_NONE;
+    }
+    case 0xE:
+      if (Chip8::tableE[low] == &Chip8::OP_NULL) {
+        return FAULT_OPCODE;
+      }
+      return chip8.registers[x] > 0xF ? FAULT_KEY : FAULT_NONE;
+    case 0xF:
+      if (Chip8::tableF[kk] == &Chip8::OP_NULL) {
+        return FAULT_OPCODE;
+      }
+      if (kk == 0x33 && chip8.index + 3u > end) {
+        return FAULT_MEMORY;
+      }
+      if ((kk == 0x55 || kk == 0x65) && chip8.index + x + 1u > end) {
+        return FAULT_MEMORY;
+      }
+      return FAULT_NONE;
+    default:
+      return FAULT_NONE;
+  }
+}
+
+struct ScanConfig {
+  unsigned int seconds = 10;          // emulated seconds per ROM
+  unsigned int cyclesPerFrame = 10;
+  unsigned int checkpointFrames = 60; // frames between golden hashes
+  unsigned int hangFrames = 300;      // frames of frozen state that count as a hang; 0 disables
+  unsigned int seed = 1;
+  std::vector<uint16_t> inputs;       // keypad mask per frame; the last one is held after the end
+};
+
+enum ScanStatus {
+  SCAN_PASS,      // every checkpoint matched the golden hashes
+  SCAN_NEW,       // ran cleanly, but there are no golden hashes for this ROM
+  SCAN_MISMATCH,  // a checkpoint hash differs from the golden one
+  SCAN_FAULT,     // stopped before an undefined access
+  SCAN_HANG,      // state froze without the ROM parking on a key wait or a jump to itself
+  SCAN_UNREADABLE
+};
+
+//First occurrence and count of one kind of wrapping access, which the scanner lets run
+struct ScanWarning {
+  ScanFault fault;
+  uint64_t frame;
+  uint16_t pc;
+  uint64_t count;
+};
+
+struct ScanResult {
+  std::string rom;
+  ScanStatus status;
+  ScanFault fault;
+  uint64_t frame;   // frame of the fault, hang or first mismatch
+  uint16_t pc;      // pc at that point
+  std::vector<std::pair<uint64_t, uint64_t>> checkpoints; // (frame, video hash)
+  double seconds;   // host time spent on this ROM
+  std::vector<ScanWarning> warnings;
+};
+
+/**
+ * Runs a ROM corpus headless for a fixed emulated time under scripted
+ * input, on every core, and compares video hashes at fixed checkpoints
+ * against golden values. Golden files are text, one "rom frame hash"
+ * line per checkpoint, and can be regenerated from a clean run.
+ */
+class CorpusScanner {
+  public:
+    explicit CorpusScanner(ScanConfig const& config, unsigned int workers = 0)
+      : config(config), workers(workers ? workers : std::max(1u, std::thread::hardware_concurrency())) {}
+
+    void Add(std::string const& rom) {
+      roms.push_back(rom);
+    }
+
+    bool LoadGolden(char const* filename) {
+      std::ifstream file(filename);
+      if (!file.is_open()) {
+        return false;
+      }
+      std::string rom;
+      uint64_t frame, hash;
+      while (file >> rom >> frame >> std::hex >> hash >> std::dec) {
+        golden[rom].emplace_back(frame, hash);
+      }
+      return true;
+    }
+
+    static bool SaveGolden(char const* filename, std::vector<ScanResult> const& results) {
+      std::ofstream file(filename, std::ios::trunc);
+      for (ScanResult const& result : results) {
+        for (auto const& checkpoint : result.checkpoints) {
+          file << result.rom << ' ' << checkpoint.first << ' ' << std::hex << checkpoint.second << std::dec << '\n';
+        }
+      }
+      return file.good();
+    }
+
+    //Scans every ROM; results are in the order the ROMs were added
+    std::vector<ScanResult> Run() {
+      std::vector<ScanResult> results(roms.size());
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> threads;
+      for (unsigned int w = 0; w < workers; ++w) {
+        threads.emplace_back([this, &results, &next] {
+          for (size_t i = next++; i < roms.size(); i = next++) {
+            results[i] = Scan(roms[i]);
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      return results;
+    }
+
+    //Prints failures, then the slowest ROMs; returns the number of failures
+    static size_t Print(std::vector<ScanResult> const& results, size_t slowest = 10) {
+      static char const* const statuses[] = {"PASS", "NEW", "MISMATCH", "FAULT", "HANG", "UNREADABLE"};
+      size_t failures = 0;
+      for (ScanResult const& result : results) {
+        if (result.status == SCAN_PASS || result.status == SCAN_NEW) {
+          continue;
+        }
+        ++failures;
+        printf("%-10s %s frame %llu pc %03X", statuses[result.status], result.rom.c_str(),
+               static_cast<unsigned long long>(result.frame), result.pc);
+        if (result.status == SCAN_FAULT) {
+          printf(" (%s)", ScanFaultName(result.fault));
+        }
+        printf("\n");
+      }
+      for (ScanResult const& result : results) {
+        for (ScanWarning const& warning : result.warnings) {
+          printf("%-10s %s frame %llu pc %03X (%s, %llu times)\n", "WARN", result.rom.c_str(), static_cast<unsigned long long>(warning.frame),
+                 warning.pc, ScanFaultName(warning.fault), static_cast<unsigned long long>(warning.count));
+        }
+      }
+
+      std::vector<ScanResult const*> order;
+      for (ScanResult const& result : results) order.push_back(&result);
+      std::sort(order.begin(), order.end(), [](ScanResult const* a, ScanResult const* b) { return a->seconds > b->seconds; });
+      for (size_t i = 0; i < order.size() && i < slowest; ++i) {
+        printf("%10.3f ms %s\n", order[i]->seconds * 1000.0, order[i]->rom.c_str());
+      }
+      printf("%zu ROMs, %zu failed\n", results.size(), failures);
+      return failures;
+    }
+
+  private:
+    ScanResult Scan(std::string const& rom) const {
+      RealClock clock;
+      Clock::Duration start = clock.Now();
+      ScanResult result = {rom, SCAN_NEW, FAULT_NONE, 0, 0, {}, 0, {}};
+
+      std::ifstream file(rom, std::ios::binary);
+      std::vector<uint8_t> image((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      if (!file.is_open()) {
+        result.status = SCAN_UNREADABLE;
+        return result;
+      }
+      Chip8 chip8(config.seed);
+      chip8.LoadROM(image.data(), image.size());
+
+      auto found = golden.find(rom);
+      std::vector<std::pair<uint64_t, uint64_t>> const* expected = found == golden.end() ? nullptr : &found->second;
+      uint64_t frames = static_cast<uint64_t>(config.seconds) * TIMER_HZ;
+      uint64_t lastState = 0;
+      unsigned int frozenFrames = 0;
+
+      for (uint64_t frame = 0; frame < frames && result.status == SCAN_NEW; ++frame) {
+        uint16_t keys = 0;
+        if (!config.inputs.empty()) {
+          keys = config.inputs[std::min<size_t>(frame, config.inputs.size() - 1)];
+        }
+        ApplyKeypadMask(keys, chip8.keypad);
+
+        for (unsigned int i = 0; i < config.cyclesPerFrame; ++i) {
+          ScanFault fault = CheckNextInstruction(chip8);
+          if (fault != FAULT_NONE && fault != FAULT_OPCODE) {
+            Warn(result, fault, frame, chip8.pc);
+          } else if (fault == FAULT_OPCODE) {
+            result.status = SCAN_FAULT;
+            result.fault = fault;
+            result.frame = frame;
+            result.pc = chip8.pc;
+            break;
+          }
+          chip8.Cycle();
+        }
+        if (result.status != SCAN_NEW) {
+          break;
+        }
+        chip8.TickTimers();
+
+        if (config.hangFrames) {
+          uint64_t state = Fnv1a(StateHash(chip8), chip8.video, sizeof(chip8.video));
+          //Waiting for a key and jumping to itself are how ROMs park on purpose
+          uint16_t next = chip8.memory.Word(chip8.pc & ADDRESS_MASK);
+          bool parked = (next & 0xF0FFu) == 0xF00Au || next == (0x1000u | (chip8.pc & ADDRESS_MASK));
+          frozenFrames = state == lastState && !parked ? frozenFrames + 1 : 0;
+          lastState = state;
+          if (frozenFrames >= config.hangFrames) {
+            result.status = SCAN_HANG;
+            result.frame = frame;
+            result.pc = chip8.pc;
+            break;
+          }
+        }
+
+        if (config.checkpointFrames && (frame + 1) % config.checkpointFrames == 0) {
+          result.checkpoints.emplace_back(frame + 1, FrameHash(chip8.video));
+        }
+      }
+
+      if (result.status == SCAN_NEW && expected) {
+        result.status = SCAN_PASS;
+        if (*expected != result.checkpoints) {
+          result.status = SCAN_MISMATCH;
+          size_t i = 0;
+          while (i < expected->size() && i < result.checkpoints.size() && (*expected)[i] == result.checkpoints[i]) ++i;
+          result.frame = i < result.checkpoints.size() ? result.checkpoints[i].first : (i < expected->size() ? (*expected)[i].first : 0);
+          result.pc = chip8.pc;
+        }
+      }
+      result.seconds = std::chrono::duration<double>(clock.Now() - start).count();
+      return result;
+    }
+
+    static void Warn(ScanResult& result, ScanFault fault, uint64_t frame, uint16_t pc) {
+      for (ScanWarning& warning : result.warnings) {
+        if (warning.fault == fault) {
+          ++warning.count;
+          return;
+        }
+      }
+      result.warnings.push_back(ScanWarning{fault, frame, pc, 1});
+    }
+
+    ScanConfig config;
+    unsigned int workers;
+    std::vector<std::string> roms;
+    std::map<std::string, std::vector<std::pair<uint64_t, uint64_t>>> golden;
+};
+
+/**
+ * Spectator stream: a sequence of updates, each a SpectatorUpdate
+ * followed by the packed rows (PACKED_ROW_SIZE bytes each) whose bits
+ * are set in rowMask, in row order. A keyframe carries every row.
+ * Unchanged frames are not sent, so frame numbers can skip.
+ */
+const unsigned int PACKED_ROW_SIZE = VIDEO_WIDTH / 8;
+const uint32_t SPECTATOR_KEYFRAME = 0x1;
+
+struct SpectatorUpdate {
+  uint64_t frame;
+  uint32_t rowMask;
+  uint32_t flags;
+};
+
+/**
+ * Fans a framebuffer out to local viewers over a Unix socket. Publish()
+ * only copies the packed frame and pokes the server thread, so the
+ * emulator never waits on viewers. Each subscriber is sent the delta
+ * from the last frame it actually received, and a new update only once
+ * its previous one has drained: a slow viewer gets fewer, larger
+ * updates instead of a growing queue.
+ */
+class SpectatorServer {
+  public:
+    explicit SpectatorServer(unsigned int keyframeInterval = 120)
+      : keyframeInterval(keyframeInterval), listenFd(-1), wakeFds{-1, -1}, latestFrame(0), running(false),
+        subscriberCount(0), updatesSent(0), bytesSent(0), framesCoalesced(0) {}
+
+    ~SpectatorServer() {
+      Stop();
+    }
+
+    //Starts accepting subscribers on a Unix socket path
+    bool Listen(char const* path) {
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if (strlen(path) >= sizeof(address.sun_path)) {
+        return false;
+      }
+      strcpy(address.sun_path, path);
+      unlink(path);
+
+      listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+          || listen(listenFd, 128) != 0 || pipe2(wakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        Stop();
+        return false;
+      }
+      socketPath = path;
+      running = true;
+      thread = std::thread(&SpectatorServer::Loop, this);
+      return true;
+    }
+
+    void Stop() {
+      if (running.exchange(false)) {
+        Wake();
+        thread.join();
+      }
+      for (Subscriber& subscriber : subscribers) {
+        close(subscriber.fd);
+      }
+      subscribers.clear();
+      subscriberCount = 0;
+      for (int& fd : wakeFds) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+      }
+      if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+        listenFd = -1;
+      }
+    }
+
+    //Called by the emulator once per frame; never blocks on subscribers
+    void Publish(uint32_t const* video) {
+      uint8_t packed[PACKED_FRAME_SIZE];
+      PackFrame(video, packed);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        memcpy(latest, packed, sizeof(latest));
+        ++latestFrame;
+      }
+      Wake();
+    }
+
+    size_t SubscriberCount() const { return subscriberCount; }
+    uint64_t UpdatesSent() const { return updatesSent; }
+    uint64_t BytesSent() const { return bytesSent; }
+    uint64_t FramesCoalesced() const { return framesCoalesced; }
+
+  private:
+    struct Subscriber {
+      int fd;
+      bool hasBase;
+      uint8_t base[PACKED_FRAME_SIZE]; // what the viewer is showing once pending drains
+      uint64_t frame;
+      uint64_t keyframe;
+      std::vector<uint8_t> pending;
+      size_t sent;
+    };
+
+    static int Disconnect(int fd) {
+      close(fd);
+      return -1;
+    }
+
+    void Wake() {
+      char byte = 0;
+      if (wakeFds[1] >= 0 && write(wakeFds[1], &byte, 1) < 0) {
+        //Pipe already full: the server has a wakeup pending anyway
+      }
+    }
+
+    void Loop() {
+      uint8_t current[PACKED_FRAME_SIZE] = {};
+      uint64_t currentFrame = 0;
+      std::vector<pollfd> fds;
+
+      while (running) {
+        fds.clear();
+        fds.push_back(pollfd{wakeFds[0], POLLIN, 0});
+        fds.push_back(pollfd{listenFd, POLLIN, 0});
+        for (Subscriber const& subscriber : subscribers) {
+          fds.push_back(pollfd{subscriber.fd, static_cast<short>(subscriber.pending.empty() ? 0 : POLLOUT), 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+          continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+          char drain[256];
+          while (read(wakeFds[0], drain, sizeof(drain)) > 0) {}
+          std::lock_guard<std::mutex> lock(mutex);
+          memcpy(current, latest, sizeof(current));
+          currentFrame = latestFrame;
+        }
+
+        if (fds[1].revents & POLLIN) {
+          int fd;
+          while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            subscribers.push_back(Subscriber{fd, false, {}, 0, 0, {}, 0});
+          }
+        }
+
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+          Subscriber& subscriber = subscribers[i];
+          bool hungUp = i + 2 < fds.size() && (fds[i + 2].revents & (POLLERR | POLLHUP));
+          if (hungUp || !Flush(subscriber)) {
+            subscriber.fd = Disconnect(subscriber.fd);
+            continue;
+          }
+          if (subscriber.pending.empty() && subscriber.frame < currentFrame) {
+            Encode(subscriber, current, currentFrame);
+            if (!Flush(subscriber)) {
+              subscriber.fd = Disconnect(subscriber.fd);
+            }
+          }
+        }
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](Subscriber const& subscriber) { return subscriber.fd < 0; }),
+                          subscribers.end());
+        subscriberCount = subscribers.size();
+      }
+    }
+
+    //Queues the delta from what the subscriber has to the current frame
+    void Encode(Subscriber& subscriber, uint8_t const* current, uint64_t frame) {
+      bool keyframe = !subscriber.hasBase || frame - subscriber.keyframe >= keyframeInterval;
+      SpectatorUpdate update = {frame, 0, keyframe ? SPECTATOR_KEYFRAME : 0u};
+      for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row) {
+        if (keyframe || memcmp(&current[row * PACKED_ROW_SIZE], &subscriber.base[row * PACKED_ROW_SIZE], PACKED_ROW_SIZE) != 0) {
+          update.rowMask |= 1u << row;
+        }
+      }
+      if (subscriber.hasBase && frame > subscriber.frame + 1) {
+        framesCoalesced += frame - subscriber.frame - 1;
+      }
+      subscriber.frame = frame;
+      if (!update.rowMask) {
+        return;
+      }
+
+      uint8_t const* header = reinterpret_cast<uint8_t const*>(&update);
+      subscriber.pending.assign(header, header + sizeof(update));
+      for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row) {
+        if (update.rowMask & (1u << row)) {
+          subscriber.pending.insert(subscriber.pending.end(), &current[row * PACKED_ROW_SIZE], &current[(row + 1) * PACKED_ROW_SIZE]);
+        }
+      }
+      subscriber.sent = 0;
+      memcpy(subscriber.base, current, sizeof(subscriber.base));
+      subscriber.hasBase = true;
+      if (keyframe) {
+        subscriber.keyframe = frame;
+      }
+      ++updatesSent;
+    }
+
+    //Writes as much of the pending update as the socket takes; false if the subscriber is gone
+    bool Flush(Subscriber& subscriber) {
+      while (subscriber.sent < subscriber.pending.size()) {
+        ssize_t written = send(subscriber.fd, &subscriber.pending[subscriber.sent], subscriber.pending.size() - subscriber.sent,
+                               MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+          return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        subscriber.sent += written;
+        bytesSent += written;
+      }
+      subscriber.pending.clear();
+      return true;
+    }
+
+    unsigned int keyframeInterval;
+    int listenFd;
+    int wakeFds[2];
+    std::string socketPath;
+    std::thread thread;
+    std::vector<Subscriber> subscribers; // owned by the server thread
+
+    std::mutex mutex;
+    uint8_t latest[PACKED_FRAME_SIZE] = {};
+    uint64_t latestFrame;
+
+    std::atomic<bool> running;
+    std::atomic<size_t> subscriberCount;
+    std::atomic<uint64_t> updatesSent;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> framesCoalesced;
+};
+
+/**
+ * Viewer side of a SpectatorServer stream.
+ */
+class SpectatorClient {
+  public:
+    SpectatorClient() : fd(-1), frame(0), bytesReceived(0) {}
+
+    ~SpectatorClient() {
+      if (fd >= 0) close(fd);
+    }
+
+    bool Connect(char const* path) {
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if (strlen(path) >= sizeof(address.sun_path)) {
+        return false;
+      }
+      strcpy(address.sun_path, path);
+      fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      return fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    }
+
+    //Blocks for the next update and applies it; false once the server is gone
+    bool Receive() {
+      SpectatorUpdate update;
+      if (!ReadFully(&update, sizeof(update))) {
+        return false;
+      }
+      for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row) {
+        if ((update.rowMask & (1u << row)) && !ReadFully(&packed[row * PACKED_ROW_SIZE], PACKED_ROW_SIZE)) {
+          return false;
+        }
+      }
+      frame = update.frame;
+      return true;
+    }
+
+    uint64_t Frame() const { return frame; }
+    uint8_t const* Packed() const { return packed; }
+    uint64_t BytesReceived() const { return bytesReceived; }
+
+  private:
+    bool ReadFully(void* data, size_t size) {
+      uint8_t* bytes = static_cast<uint8_t*>(data);
+      while (size) {
+        ssize_t count = recv(fd, bytes, size, 0);
+        if (count <= 0) {
+          return false;
+        }
+        bytes += count;
+        size -= count;
+        bytesReceived += count;
+      }
+      return true;
+    }
+
+    int fd;
+    uint64_t frame;
+    uint64_t bytesReceived;
+    uint8_t packed[PACKED_FRAME_SIZE] = {};
+};
+
+/**
+ * Streams the draw ROM to `subscribers` viewer threads, one of them
+ * deliberately slow, as fast as the emulator runs. Reports subscribers
+ * connected per second, frames published, updates and bytes delivered
+ * to viewers, and bytes per delivered frame update. That last entry is
+ * a ratio rather than a timing: its Rate() is bytes over updates.
+ * Returns nothing if the server cannot listen or not every viewer
+ * subscribes within connectTimeout.
+ */
+std::vector<BenchmarkResult> BenchmarkSpectators(unsigned int subscribers = 32, uint64_t frames = 20000,
+                                                 Clock::Duration connectTimeout = std::chrono::seconds(5)) {
+  SyntheticRom rom = SyntheticRomNamed("draw");
+  if (rom.code.empty()) {
+    return {};
+  }
+  std::string path = "/tmp/chip8-spectator-" + std::to_string(getpid()) + ".sock";
+  SpectatorServer server;
+  if (!server.Listen(path.c_str())) {
+    return {};
+  }
+
+  std::atomic<uint64_t> updates(0);
+  std::atomic<uint64_t> bytes(0);
+  std::vector<std::thread> viewers;
+  RealClock clock;
+  Clock::Duration connectStart = clock.Now();
+  for (unsigned int i = 0; i < subscribers; ++i) {
+    viewers.emplace_back([&, i] {
+      SpectatorClient client;
+      if (!client.Connect(path.c_str())) {
+        return;
+      }
+      uint64_t received = 0;
+      while (client.Receive()) {
+        ++received;
+        if (i == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+      }
+      updates += received;
+      bytes += client.BytesReceived();
+    });
+  }
+  while (server.SubscriberCount() < subscribers && clock.Now() - connectStart < connectTimeout) {
+    std::this_thread::yield();
+  }
+  size_t connected = server.SubscriberCount();
+  BenchmarkResult subscribe{"spectator subscribers", connected, std::chrono::duration<double>(clock.Now() - connectStart).count()};
+  if (connected < subscribers) {
+    printf("SKIP spectators: %zu of %u subscribers connected\n", connected, subscribers);
+    server.Stop();
+    for (std::thread& viewer : viewers) {
+      viewer.join();
+    }
+    return {};
+  }
+
+  Chip8 chip8(1);
+  chip8.LoadROM(rom.code.data(), rom.code.size());
+  Clock::Duration start = clock.Now();
+  BenchmarkResult publish = RunBenchmark("spectator publish", frames, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      chip8.RunFrame(10);
+      server.Publish(chip8.video);
+    }
+  });
+
+  server.Stop();
+  for (std::thread& viewer : viewers) {
+    viewer.join();
+  }
+  double seconds = std::chrono::duration<double>(clock.Now() - start).count();
+  return {subscribe, publish, BenchmarkResult{"spectator updates", updates, seconds}, BenchmarkResult{"spectator bytes", bytes, seconds},
+          BenchmarkResult{"spectator bytes/frame", bytes, static_cast<double>(updates)}};
+}
+
+/**
+ * Static value-range analysis of a freshly loaded program. Starting
+ * from the reset state at START_ADDRESS, it follows every reachable
+ * instruction (calls, returns, skips, computed jumps) with an interval
+ * for each of V0-VF and I, joining at merge points until nothing
+ * changes, and then decides for every I-relative access (Dxyn, Fx33,
+ * Fx55, Fx65) whether it provably stays inside memory without the
+ * address wrapping, and for every Dxyn whether the sprite provably
+ * stays on screen without wrapping.
+ *
+ * Conditional skips on a constant narrow the register they test, so
+ * counted loops keep bounded registers. I is widened to the top of its
+ * range after a few passes through the same instruction, since the
+ * intervals cannot relate it to a loop counter. If any reachable store
+ * may land on reachable code the program is treated as self-modifying
+ * and nothing is proven. The results describe runs from reset only,
+ * not machines restored with LoadState; VerifyRangeAnalysis checks them
+ * against the interpreter.
+ */
+class RangeAnalysis {
+  public:
+    struct Interval {
+      uint16_t lo;
+      uint16_t hi;
+
+      bool operator==(Interval const& other) const { return lo == other.lo && hi == other.hi; }
+    };
+
+    struct Stats {
+      size_t memorySites;  // reachable Dxyn, Fx33, Fx55 and Fx65
+      size_t memorySafe;
+      size_t displaySites; // reachable Dxyn
+      size_t displaySafe;
+      bool selfModifying;
+
+      //Fraction of all checked accesses proven safe
+      double Coverage() const {
+        size_t sites = memorySites + displaySites;
+        return sites ? static_cast<double>(memorySafe + displaySafe) / sites : 1.0;
+      }
+    };
+
+    explicit RangeAnalysis(GuestMemory const& memory) : stats{} {
+      memory.Read(0, this->memory, sizeof(this->memory));
+      memset(flags, 0, sizeof(flags));
+      Analyze();
+    }
+
+    bool Reachable(uint16_t address) const {
+      return address < 4096 && (flags[address] & RANGE_REACHED);
+    }
+
+    //Every access the instruction at address makes through I is inside memory
+    bool MemorySafe(uint16_t address) const {
+      return address < 4096 && (flags[address] & RANGE_MEMORY_SAFE);
+    }
+
+    //The Dxyn at address never draws past the video buffer
+    bool DisplaySafe(uint16_t address) const {
+      return address < 4096 && (flags[address] & RANGE_DISPLAY_SAFE);
+    }
+
+    //Instruction the analysis saw at address; like the interpreter, 0xFFF wraps to 0x000
+    uint16_t OpcodeAt(uint16_t address) const {
+      address &= ADDRESS_MASK;
+      return static_cast<uint16_t>((memory[address] << 8u) | memory[(address + 1) & ADDRESS_MASK]);
+    }
+
+    //Interval of I on entry to the instruction at address
+    Interval IndexAt(uint16_t address) const {
+      return states[address & ADDRESS_MASK].index;
+    }
+
+    //Interval of Vx on entry to the instruction at address
+    Interval RegisterAt(uint16_t address, unsigned int x) const {
+      return states[address & ADDRESS_MASK].v[x & 0xFu];
+    }
+
+    //Bytes an I-relative instruction touches past I, or 0 if it does not use I
+    static unsigned int AccessLength(uint16_t op) {
+      if ((op & 0xF000u) == 0xD000u) return op & 0xFu;
+      if ((op & 0xF0FFu) == 0xF033u) return 3;
+      if ((op & 0xF0FFu) == 0xF055u || (op & 0xF0FFu) == 0xF065u) return ((op & 0x0F00u) >> 8u) + 1;
+      return 0;
+    }
+
+    Stats const& GetStats() const {
+      return stats;
+    }
+
+    void Print() const {
+      printf("range analysis: %zu/%zu memory accesses and %zu/%zu draws proven safe (%.1f%%)%s\n",
+             stats.memorySafe, stats.memorySites, stats.displaySafe, stats.displaySites, stats.Coverage() * 100.0,
+             stats.selfModifying ? ", self-modifying: nothing proven" : "");
+    }
+
+  private:
+    static const uint8_t RANGE_REACHED = 0x1;
+    static const uint8_t RANGE_MEMORY_SAFE = 0x2;
+    static const uint8_t RANGE_DISPLAY_SAFE = 0x4;
+    static const unsigned int WIDEN_AFTER = 8;
+
+    struct State {
+      Interval v[16];
+      Interval index;
+      Interval depth; // return addresses on the stack, up to 16
+      bool reached;
+    };
+
+    static Interval Join(Interval a, Interval b) {
+      return Interval{std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+    }
+
+    //Interval of an 8-bit result, or all of 0-255 if it may wrap
+    static Interval Byte(int lo, int hi) {
+      return lo >= 0 && hi <= 255 ? Interval{static_cast<uint16_t>(lo), static_cast<uint16_t>(hi)} : Interval{0, 255};
+    }
+
+    //Smallest all-ones mask covering the value
+    static uint16_t Fill(uint16_t value) {
+      uint16_t mask = 0;
+      while (mask < value) mask = (mask << 1u) | 1u;
+      return mask;
+    }
+
+    //Joins a state into the one at an address; queues the address if it grew.
+    //The interpreter fetches from pc & ADDRESS_MASK, so targets wrap the same way
+    void Flow(uint32_t address, State const& state) {
+      address &= ADDRESS_MASK;
+      State& target = states[address];
+      if (!target.reached) {
+        target = state;
+        target.reached = true;
+        worklist.push_back(static_cast<uint16_t>(address));
+        return;
+      }
+      State joined = target;
+      bool changed = false;
+      for (unsigned int reg = 0; reg < 16; ++reg) {
+        joined.v[reg] = Join(target.v[reg], state.v[reg]);
+        changed |= !(joined.v[reg] == target.v[reg]);
+      }
+      joined.depth = Join(target.depth, state.depth);
+      changed |= !(joined.depth == target.depth);
+      joined.index = Join(target.index, state.index);
+      if (!(joined.index == target.index)) {
+        changed = true;
+        if (++visits[address] > WIDEN_AFTER) {
+          joined.index = Interval{joined.index.lo == target.index.lo ? joined.index.lo : uint16_t(0),
+                                  joined.index.hi == target.index.hi ? joined.index.hi : uint16_t(0xFFFF)};
+        }
+      }
+      if (changed) {
+        target = joined;
+        worklist.push_back(static_cast<uint16_t>(address));
+      }
+    }
+
+    /**
+     * Sends the joined state of every return to every return site, at the
+     * depth of the call before it. Once the stack may underflow or wrap,
+     * a return may pop a zeroed slot and land on 0x000, or pop a slot
+     * another call overwrote, and depths no longer say anything.
+     */
+    void Return() {
+      for (uint16_t site : returnSites) {
+        State state = returned;
+        state.depth = stackUnknown ? Interval{0, 16} : states[(site - 2u) & ADDRESS_MASK].depth;
+        Flow(site, state);
+      }
+      if (stackUnknown) {
+        State state = returned;
+        state.depth = Interval{0, 16};
+        Flow(0, state);
+      }
+    }
+
+    void Analyze() {
+      State reset = {};
+      reset.reached = true;
+      memset(states, 0, sizeof(states));
+      memset(visits, 0, sizeof(visits));
+      returned = State{};
+      returnSites.clear();
+      stackUnknown = false;
+      Flow(START_ADDRESS, reset);
+
+      while (!worklist.empty()) {
+        uint16_t address = worklist.back();
+        worklist.pop_back();
+        State state = states[address];
+        uint16_t op = OpcodeAt(address);
+        uint8_t x = (op & 0x0F00u) >> 8u;
+        uint8_t y = (op & 0x00F0u) >> 4u;
+        uint8_t kk = op & 0x00FFu;
+        uint16_t nnn = op & 0x0FFFu;
+        Interval& vx = state.v[x];
+        Interval vy = state.v[y];
+        uint32_t next = address + 2u;
+
+        switch (op >> 12u) {
+          case 0x0:
+            //Table0 dispatches on the low nibble, so every 0nnE returns
+            if ((op & 0xFu) == 0xEu) {
+              State joined = returned.reached ? returned : state;
+              for (unsigned int reg = 0; reg < 16; ++reg) joined.v[reg] = Join(joined.v[reg], state.v[reg]);
+              joined.index = Join(joined.index, state.index);
+              joined.reached = true;
+              returned = joined;
+              stackUnknown |= state.depth.lo == 0;
+              Return();
+              continue;
+            }
+            break;
+          case 0x1:
+            Flow(nnn, state);
+            continue;
+          case 0x2:
+            if (std::find(returnSites.begin(), returnSites.end(), next & ADDRESS_MASK) == returnSites.end()) {
+              returnSites.push_back(static_cast<uint16_t>(next & ADDRESS_MASK));
+            }
+            //Past 16 deep the stack wraps and a return may pop another call's slot
+            stackUnknown |= state.depth.hi >= 16;
+            if (returned.reached) Return();
+            state.depth = Interval{uint16_t(std::min(state.depth.lo + 1, 16)), uint16_t(std::min(state.depth.hi + 1, 16))};
+            Flow(nnn, state);
+            continue;
+          case 0x3:
+          case 0x4: {
+            //3xkk skips when equal, 4xkk when not; each path learns something about Vx
+            State equal = state;
+            State unequal = state;
+            bool canEqual = kk >= vx.lo && kk <= vx.hi;
+            bool canDiffer = !(vx.lo == kk && vx.hi == kk);
+            equal.v[x] = Interval{kk, kk};
+            if (vx.lo == kk && vx.hi > kk) unequal.v[x].lo = kk + 1;
+            if (vx.hi == kk && vx.lo < kk) unequal.v[x].hi = kk - 1;
+            bool skipOnEqual = (op >> 12u) == 0x3;
+            if (canEqual) Flow(skipOnEqual ? next + 2 : next, equal);
+            if (canDiffer) Flow(skipOnEqual ? next : next + 2, unequal);
+            continue;
+          }
+          case 0x5:
+          case 0x9:
+          case 0xE:
+            Flow(next, state);
+            Flow(next + 2, state);
+            continue;
+          case 0x6:
+            vx = Interval{kk, kk};
+            break;
+          case 0x7:
+            vx = Byte(vx.lo + kk, vx.hi + kk);
+            break;
+          case 0x8:
+            switch (op & 0xFu) {
+              case 0x0: vx = vy; break;
+              case 0x1: vx = Interval{std::max(vx.lo, vy.lo), Fill(std::max(vx.hi, vy.hi))}; break;
+              case 0x2: vx = Interval{0, std::min(vx.hi, vy.hi)}; break;
+              case 0x3: vx = Interval{0, Fill(std::max(vx.hi, vy.hi))}; break;
+              case 0x4: state.v[15] = Interval{0, 1}; vx = Byte(vx.lo + state.v[y].lo, vx.hi + state.v[y].hi); break;
+              case 0x5: state.v[15] = Interval{0, 1}; vx = Byte(vx.lo - state.v[y].hi, vx.hi - state.v[y].lo); break;
+              case 0x6: state.v[15] = Interval{0, 1}; vy = state.v[y]; vx = Interval{uint16_t(vy.lo >> 1), uint16_t(vy.hi >> 1)}; break;
+              case 0x7: state.v[15] = Interval{0, 1}; vx = Byte(state.v[y].lo - vx.hi, state.v[y].hi - vx.lo); break;
+              case 0xE: state.v[15] = Interval{0, 1}; vy = state.v[y]; vx = Byte(vy.lo * 2, vy.hi * 2); break;
+            }
+            break;
+          case 0xA:
+            state.index = Interval{nnn, nnn};
+            break;
+          case 0xB:
+            for (unsigned int offset = state.v[0].lo; offset <= state.v[0].hi; ++offset) {
+              Flow(nnn + offset, state);
+            }
+            continue;
+          case 0xC:
+            vx = Interval{0, kk};
+            break;
+          case 0xD:
+            state.v[15] = Interval{0, 1};
+            break;
+          case 0xF:
+            switch (kk) {
+              case 0x07: vx = Interval{0, 255}; break;
+              case 0x0A:
+                Flow(address, state);
+                vx = Interval{0, 15};
+                break;
+              case 0x1E: {
+                uint32_t hi = state.index.hi + vx.hi;
+                state.index = hi <= 0xFFFFu ? Interval{uint16_t(state.index.lo + vx.lo), uint16_t(hi)} : Interval{0, 0xFFFF};
+                break;
+              }
+              case 0x29:
+                state.index = Interval{uint16_t(FONTSET_START_ADDRESS + 5 * vx.lo), uint16_t(FONTSET_START_ADDRESS + 5 * vx.hi)};
+                break;
+              case 0x65:
+                for (unsigned int reg = 0; reg <= x; ++reg) state.v[reg] = Interval{0, 255};
+                break;
+            }
+            break;
+        }
+        Flow(next, state);
+      }
+
+      Classify();
+    }
+
+    void Classify() {
+      bool code[4096] = {};
+      for (unsigned int address = 0; address < sizeof(memory); ++address) {
+        if (states[address].reached) {
+          flags[address] |= RANGE_REACHED;
+          code[address] = code[(address + 1) & ADDRESS_MASK] = true;
+        }
+      }
+
+      for (unsigned int address = 0; address < sizeof(memory); ++address) {
+        if (!states[address].reached) {
+          continue;
+        }
+        State const& state = states[address];
+        uint16_t op = OpcodeAt(static_cast<uint16_t>(address));
+        unsigned int length = AccessLength(op);
+        bool store = (op & 0xF0FFu) == 0xF033u || (op & 0xF0FFu) == 0xF055u;
+        bool draw = (op & 0xF000u) == 0xD000u;
+
+        if (length || draw) {
+          ++stats.memorySites;
+          if (length == 0 || state.index.hi + length <= sizeof(memory)) {
+            ++stats.memorySafe;
+            flags[address] |= RANGE_MEMORY_SAFE;
+          }
+        }
+        if (store) {
+          //Stores wrap like the interpreter's, so a store past 0xFFF may still hit code
+          uint32_t last = std::min<uint32_t>(state.index.hi + length, state.index.lo + sizeof(memory));
+          for (uint32_t byte = state.index.lo; byte < last; ++byte) {
+            stats.selfModifying |= code[byte & ADDRESS_MASK];
+          }
+        }
+        if (draw) {
+          ++stats.displaySites;
+          Interval vx = state.v[(op & 0x0F00u) >> 8u];
+          Interval vy = state.v[(op & 0x00F0u) >> 4u];
+          bool sameRow = vy.lo / VIDEO_HEIGHT == vy.hi / VIDEO_HEIGHT;
+          bool sameColumn = vx.lo / VIDEO_WIDTH == vx.hi / VIDEO_WIDTH;
+          unsigned int bottom = (sameRow ? vy.hi % VIDEO_HEIGHT : VIDEO_HEIGHT - 1) + (op & 0xFu);
+          unsigned int right = (sameColumn ? vx.hi % VIDEO_WIDTH : VIDEO_WIDTH - 1) + 8;
+          if ((bottom <= VIDEO_HEIGHT && right <= VIDEO_WIDTH) || (op & 0xFu) == 0) {
+            ++stats.displaySafe;
+            flags[address] |= RANGE_DISPLAY_SAFE;
+          }
+        }
+      }
+
+      if (stats.selfModifying) {
+        for (uint8_t& flag : flags) {
+          flag &= RANGE_REACHED;
+        }
+        stats.memorySafe = 0;
+        stats.displaySafe = 0;
+      }
+    }
+
+    uint8_t memory[4096];
+    uint8_t flags[4096];
+    State states[4096];
+    uint16_t visits[4096];
+    std::vector<uint16_t> worklist;
+    State returned;                   // join of the states at every reachable 00EE
+    std::vector<uint16_t> returnSites; // instruction after every reachable 2nnn
+    bool stackUnknown;
+    Stats stats;
+};
+
+/**
+ * Runs a freshly loaded program on the interpreter for up to `cycles`
+ * instructions, holding `keys` down, and checks the analysis against
+ * every instruction executed: it was reached, I and V0-VF lie in the
+ * intervals given for it, and an access proven safe stays inside memory
+ * and on screen. Returns what first disagreed, or an empty string. For a
+ * self-modifying program only the (empty) set of proofs is checked.
+ */
+std::string VerifyRangeAnalysis(uint8_t const* rom, size_t size, uint64_t cycles, uint16_t keys = 0, unsigned int seed = 0) {
+  Chip8 chip8(seed);
+  chip8.LoadROM(rom, size);
+  ApplyKeypadMask(keys, chip8.keypad);
+  RangeAnalysis analysis(chip8.memory);
+  bool modelled = !analysis.GetStats().selfModifying;
+
+  for (uint64_t cycle = 0; cycle < cycles; ++cycle) {
+    uint16_t address = chip8.pc & ADDRESS_MASK;
+    uint16_t op = chip8.memory.Word(address);
+    std::ostringstream report;
+    report << std::hex << "cycle " << std::dec << cycle << std::hex << ", pc=" << address << " op=" << op << ": ";
+
+    if (modelled) {
+      RangeAnalysis::Interval index = analysis.IndexAt(address);
+      if (!analysis.Reachable(address)) {
+        return report.str() + "executed but not reached";
+      }
+      if (op != analysis.OpcodeAt(address)) {
+        return report.str() + "code changed in a program not marked self-modifying";
+      }
+      if (chip8.index < index.lo || chip8.index > index.hi) {
+        report << "I=" << chip8.index << " outside " << index.lo << "-" << index.hi;
+        return report.str();
+      }
+      for (unsigned int reg = 0; reg < 16; ++reg) {
+        RangeAnalysis::Interval v = analysis.RegisterAt(address, reg);
+        if (chip8.registers[reg] < v.lo || chip8.registers[reg] > v.hi) {
+          report << "V" << reg << "=" << static_cast<unsigned int>(chip8.registers[reg]) << " outside " << v.lo << "-" << v.hi;
+          return report.str();
+        }
+      }
+    }
+    if (analysis.MemorySafe(address) && chip8.index + RangeAnalysis::AccessLength(op) > MEMORY_SIZE) {
+      return report.str() + "proven access runs past memory";
+    }
+    if (analysis.DisplaySafe(address) && (op & 0xFu) &&
+        (chip8.registers[(op & 0x0F00u) >> 8u] % VIDEO_WIDTH + 8 > VIDEO_WIDTH ||
+         chip8.registers[(op & 0x00F0u) >> 4u] % VIDEO_HEIGHT + (op & 0xFu) > VIDEO_HEIGHT)) {
+      return report.str() + "proven draw wraps the screen";
+    }
+    chip8.Cycle();
+  }
+  return std::string();
+}
+
+/**
+ * VerifyRangeAnalysis over the synthetic ROMs and count random programs
+ * with random keys held. Prints every disagreement; returns how many
+ * programs disagreed.
+ */
+unsigned int CheckRangeAnalysis(unsigned int count = 3000, uint64_t cycles = 5000, unsigned int seed = 1) {
+  unsigned int failures = 0;
+  for (SyntheticRom const& rom : SyntheticRoms()) {
+    std::string report = VerifyRangeAnalysis(rom.code.data(), rom.code.size(), cycles);
+    if (!report.empty()) {
+      printf("range analysis %s: %s\n", rom.name, report.c_str());
+      ++failures;
+    }
+  }
+  std::mt19937 rng(seed);
+  for (unsigned int i = 0; i < count; ++i) {
+    std::vector<uint8_t> rom = RandomRom(rng, 16 + rng() % 240);
+    uint16_t keys = static_cast<uint16_t>(rng());
+    std::string report = VerifyRangeAnalysis(rom.data(), rom.size(), cycles, keys, i);
+    if (!report.empty()) {
+      printf("range analysis random %u: %s\n", i, report.c_str());
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+/**
+ * Threaded interpreter over a Chip8's memory. Each address is decoded
+ * once to a handler plus its operands, and each handler ends by
+ * tail-calling the handler of the instruction at the new pc, so control
+ * never returns to a dispatch loop until the instruction budget runs
+ * out. pc, I and the remaining budget travel in argument registers;
+ * V0-VF, the stack and the timers stay in the Chip8.
+ *
+ * Hot register, branch and stack instructions are implemented here;
+ * everything else (drawing, keys, RNG, BCD and block loads/stores)
+ * syncs pc and I back to the Chip8 and calls its own handler, so the
+ * two backends cannot drift apart. Instructions are decoded when first
+ * executed, and stores send the bytes they touch back to undecoded;
+ * call Invalidate() after changing memory behind its back (LoadROM,
+ * LoadState).
+ *
+ * With clang, or GCC 15 and later, every tail call is guaranteed. Older
+ * GCC only turns them into jumps when optimizing, so there each Run()
+ * is split into chains of at most THREADED_CHAIN instructions to bound
+ * the stack at -O0.
+ */
+class ThreadedInterpreter {
+  public:
+    explicit ThreadedInterpreter(Chip8& chip8) : chip8(chip8), analysis(nullptr), exitPc(0), exitIndex(0) {
+      Invalidate();
+    }
+
+    /**
+     * Runs the Fx33, Fx55 and Fx65 instructions the analysis proved in
+     * range inline, without going through the Chip8's handlers. The
+     * analysis must outlive the interpreter and describe the program
+     * this machine is running from reset.
+     */
+    void UseRangeAnalysis(RangeAnalysis const* rangeAnalysis) {
+      analysis = rangeAnalysis;
+      Invalidate();
+    }
+
+    //Drops all decoded instructions; each is decoded again when next executed
+    void Invalidate() {
+      for (Op& op : code) {
+        op.handler = &Undecoded;
+      }
+    }
+
+    //Executes the given number of instructions
+    void Run(uint64_t instructions) {
+      while (instructions) {
+        uint64_t chain = std::min<uint64_t>(instructions, THREADED_CHAIN);
+        code[chip8.pc & 0xFFFu].handler(*this, chip8.pc, chip8.index, chain);
+        chip8.pc = static_cast<uint16_t>(exitPc);
+        chip8.index = static_cast<uint16_t>(exitIndex);
+        instructions -= chain;
+      }
+    }
+
+    //Runs one 60 Hz frame: the given number of instructions, then a timer tick
+    void RunFrame(unsigned int instructions) {
+      Run(instructions);
+      chip8.TickTimers();
+    }
+
+  private:
+#ifdef CHIP8_HAVE_MUSTTAIL
+    static constexpr uint64_t THREADED_CHAIN = UINT64_MAX;
+#else
+    static constexpr uint64_t THREADED_CHAIN = 1024;
+#endif
+
+    typedef void (*Handler)(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining);
+
+    struct Op {
+      Handler handler;
+      uint16_t opcode;
+      uint16_t nnn;
+      uint8_t x;
+      uint8_t y;
+      uint8_t kk;
+    };
+
+//Ends a handler: stop when the budget is spent, otherwise jump to the next instruction
+#define THREADED_NEXT(self, pc, index, remaining) \
+    if (--(remaining) == 0) { \
+      (self).exitPc = (pc); \
+      (self).exitIndex = (index); \
+      return; \
+    } \
+    CHIP8_MUSTTAIL return (self).code[(pc) & 0xFFFu].handler(self, pc, index, remaining)
+
+    void Decode(unsigned int address) {
+      uint16_t op = chip8.memory.Word(address);
+      Op& decoded = code[address];
+      decoded.opcode = op;
+      decoded.nnn = op & 0x0FFFu;
+      decoded.x = (op & 0x0F00u) >> 8u;
+      decoded.y = (op & 0x00F0u) >> 4u;
+      decoded.kk = op & 0x00FFu;
+      decoded.handler = &Fallback;
+
+      switch (op >> 12u) {
+        case 0x0: if (op == 0x00EEu) decoded.handler = &OpRet; break;
+        case 0x1: decoded.handler = &OpJump; break;
+        case 0x2: decoded.handler = &OpCall; break;
+        case 0x3: decoded.handler = &OpSkipEqualByte; break;
+        case 0x4: decoded.handler = &OpSkipNotEqualByte; break;
+        case 0x5: if ((op & 0xFu) == 0) decoded.handler = &OpSkipEqual; break;
+        case 0x6: decoded.handler = &OpLoadByte; break;
+        case 0x7: decoded.handler = &OpAddByte; break;
+        case 0x8:
+          switch (op & 0xFu) {
+            case 0x0: decoded.handler = &OpAlu<0x0>; break;
+            case 0x1: decoded.handler = &OpAlu<0x1>; break;
+            case 0x2: decoded.handler = &OpAlu<0x2>; break;
+            case 0x3: decoded.handler = &OpAlu<0x3>; break;
+            case 0x4: decoded.handler = &OpAlu<0x4>; break;
+            case 0x5: decoded.handler = &OpAlu<0x5>; break;
+            case 0x6: decoded.handler = &OpAlu<0x6>; break;
+            case 0x7: decoded.handler = &OpAlu<0x7>; break;
+            case 0xE: decoded.handler = &OpAlu<0xE>; break;
+          }
+          break;
+        case 0x9: if ((op & 0xFu) == 0) decoded.handler = &OpSkipNotEqual; break;
+        case 0xA: decoded.handler = &OpLoadIndex; break;
+        case 0xB: decoded.handler = &OpJumpOffset; break;
+        case 0xF:
+          switch (op & 0xFFu) {
+            case 0x07: decoded.handler = &OpReadDelay; break;
+            case 0x15: decoded.handler = &OpSetDelay; break;
+            case 0x18: decoded.handler = &OpSetSound; break;
+            case 0x1E: decoded.handler = &OpAddIndex; break;
+          }
+          if (analysis && analysis->MemorySafe(address) && analysis->OpcodeAt(address) == op) {
+            switch (op & 0xFFu) {
+              case 0x33: decoded.handler = &OpStoreBcd; break;
+              case 0x55: decoded.handler = &OpStoreRegisters; break;
+              case 0x65: decoded.handler = &OpLoadRegisters; break;
+            }
+          }
+          break;
+      }
+    }
+
+    //Decodes the instruction in place and runs it
+    static void Undecoded(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.Decode(pc & 0xFFFu);
+      CHIP8_MUSTTAIL return self.code[pc & 0xFFFu].handler(self, pc, index, remaining);
+    }
+
+    static void OpRet(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      --self.chip8.sp;
+      pc = self.chip8.stack[self.chip8.sp & 0xFu];
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpJump(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      pc = self.code[pc & 0xFFFu].nnn;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpCall(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.stack[self.chip8.sp & 0xFu] = static_cast<uint16_t>(pc + 2);
+      ++self.chip8.sp;
+      pc = self.code[pc & 0xFFFu].nnn;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSkipEqualByte(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      pc += self.chip8.registers[op.x] == op.kk ? 4 : 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSkipNotEqualByte(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      pc += self.chip8.registers[op.x] != op.kk ? 4 : 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSkipEqual(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      pc += self.chip8.registers[op.x] == self.chip8.registers[op.y] ? 4 : 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSkipNotEqual(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      pc += self.chip8.registers[op.x] != self.chip8.registers[op.y] ? 4 : 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpLoadByte(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      self.chip8.registers[op.x] = op.kk;
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpAddByte(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      self.chip8.registers[op.x] += op.kk;
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    //8xyN, in the same order of flag and result writes as the Chip8 handlers
+    template <unsigned int N>
+    static void OpAlu(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Op const& op = self.code[pc & 0xFFFu];
+      uint8_t* v = self.chip8.registers;
+      switch (N) {
+        case 0x0: v[op.x] = v[op.y]; break;
+        case 0x1: v[op.x] |= v[op.y]; break;
+        case 0x2: v[op.x] &= v[op.y]; break;
+        case 0x3: v[op.x] ^= v[op.y]; break;
+        case 0x4: v[15] = v[op.x] + v[op.y] > 255u ? 1 : 0; v[op.x] += v[op.y]; break;
+        case 0x5: v[15] = v[op.x] > v[op.y] ? 1 : 0; v[op.x] -= v[op.y]; break;
+        case 0x6: v[15] = v[op.y] & 0x1u; v[op.x] = v[op.y] >> 1; break;
+        case 0x7: v[15] = v[op.y] > v[op.x] ? 1 : 0; v[op.x] = v[op.y] - v[op.x]; break;
+        case 0xE: v[15] = (v[op.y] & 0xF0u) >> 7u; v[op.x] = v[op.y] << 1; break;
+      }
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpLoadIndex(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      index = self.code[pc & 0xFFFu].nnn;
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpJumpOffset(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      pc = static_cast<uint16_t>(self.code[pc & 0xFFFu].nnn + self.chip8.registers[0]);
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpReadDelay(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.registers[self.code[pc & 0xFFFu].x] = self.chip8.delayTimer;
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSetDelay(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.delayTimer = self.chip8.registers[self.code[pc & 0xFFFu].x];
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpSetSound(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.soundTimer = self.chip8.registers[self.code[pc & 0xFFFu].x];
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpAddIndex(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      index = static_cast<uint16_t>(index + self.chip8.registers[self.code[pc & 0xFFFu].x]);
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    //Proven in range and away from code by RangeAnalysis: no checks, nothing to re-decode
+    static void OpStoreBcd(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      GuestMemory& memory = self.chip8.memory;
+      uint8_t value = self.chip8.registers[self.code[pc & 0xFFFu].x];
+      memory.Write(index + 2, value % 10);
+      value /= 10;
+      memory.Write(index + 1, value % 10);
+      value /= 10;
+      memory.Write(index, value % 10);
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpStoreRegisters(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.memory.Write(index, self.chip8.registers, self.code[pc & 0xFFFu].x + 1u);
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    static void OpLoadRegisters(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      self.chip8.memory.Read(index, self.chip8.registers, self.code[pc & 0xFFFu].x + 1u);
+      pc += 2;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+    //Runs the instruction on the Chip8 itself, then re-decodes anything it stored to
+    static void Fallback(ThreadedInterpreter& self, uint32_t pc, uint32_t index, uint64_t remaining) {
+      Chip8& chip8 = self.chip8;
+      chip8.pc = static_cast<uint16_t>(pc);
+      chip8.index = static_cast<uint16_t>(index);
+      chip8.CycleSwitch();
+
+      uint16_t op = chip8.opcode;
+      unsigned int stored = (op & 0xF0FFu) == 0xF033u ? 3u : (op & 0xF0FFu) == 0xF055u ? ((op & 0x0F00u) >> 8u) + 1u : 0u;
+      //Each stored byte and the one before it (the first half of an instruction ending there), wrapping like the store
+      for (unsigned int k = 0; stored && k <= stored; ++k) {
+        self.code[(index + k - 1) & ADDRESS_MASK].handler = &Undecoded;
+      }
+
+      pc = chip8.pc;
+      index = chip8.index;
+      THREADED_NEXT(self, pc, index, remaining);
+    }
+
+#undef THREADED_NEXT
+
+    Chip8& chip8;
+    RangeAnalysis const* analysis;
+    Op code[4096];
+    uint32_t exitPc;
+    uint32_t exitIndex;
+};
+
+/**
+ * Runs one program on the three backends (Cycle() tables, CycleSwitch()
+ * and the threaded interpreter) side by side and compares state and
+ * video hashes after every frame. Returns the first frame that
+ * differed, or an empty string.
+ */
+std::string VerifyBackends(uint8_t const* rom, size_t size, uint64_t frames, unsigned int cyclesPerFrame, uint16_t keys = 0, unsigned int seed = 0) {
+  Chip8 tables(seed);
+  Chip8 switched(seed);
+  Chip8 threaded(seed);
+  for (Chip8* chip8 : {&tables, &switched, &threaded}) {
+    chip8->LoadROM(rom, size);
+    ApplyKeypadMask(keys, chip8->keypad);
+  }
+  ThreadedInterpreter interpreter(threaded);
+
+  for (uint64_t frame = 0; frame < frames; ++frame) {
+    tables.RunFrame(cyclesPerFrame);
+    for (unsigned int i = 0; i < cyclesPerFrame; ++i) {
+      switched.CycleSwitch();
+    }
+    switched.TickTimers();
+    interpreter.RunFrame(cyclesPerFrame);
+
+    bool switchSame = StateHash(switched) == StateHash(tables) && FrameHash(switched.video) == FrameHash(tables.video);
+    bool threadedSame = StateHash(threaded) == StateHash(tables) && FrameHash(threaded.video) == FrameHash(tables.video);
+    if (!switchSame || !threadedSame) {
+      std::ostringstream report;
+      report << "frame " << frame << ": " << (switchSame ? "" : "switch ") << (threadedSame ? "" : "threaded ")
+             << "differs from tables; pc tables=" << std::hex << tables.pc
+             << " switch=" << switched.pc << " threaded=" << threaded.pc;
+      return report.str();
+    }
+  }
+  return std::string();
+}
+
+/**
+ * VerifyBackends over the synthetic ROMs and count random programs with
+ * random keys held. Prints every disagreement; returns how many
+ * programs disagreed.
+ */
+unsigned int CheckBackends(unsigned int count = 300, uint64_t frames = 100, unsigned int cyclesPerFrame = 50, unsigned int seed = 1) {
+  unsigned int failures = 0;
+  for (SyntheticRom const& rom : SyntheticRoms()) {
+    std::string report = VerifyBackends(rom.code.data(), rom.code.size(), frames, cyclesPerFrame);
+    if (!report.empty()) {
+      printf("backends %s: %s\n", rom.name, report.c_str());
+      ++failures;
+    }
+  }
+  std::mt19937 rng(seed);
+  for (unsigned int i = 0; i < count; ++i) {
+    std::vector<uint8_t> rom = RandomRom(rng, 64 + rng() % (MEMORY_SIZE - START_ADDRESS - 64));
+    uint16_t keys = static_cast<uint16_t>(rng());
+    std::string report = VerifyBackends(rom.data(), rom.size(), frames, cyclesPerFrame, keys, i);
+    if (!report.empty()) {
+      printf("backends random %u: %s\n", i, report.c_str());
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+/**
+ * Emulated instructions/sec of the three dispatch strategies on the
+ * synthetic ROMs: the pointer-to-member tables in Cycle(), the switch
+ * in CycleSwitch() and the tail-call threaded interpreter.
+ */
+std::vector<BenchmarkResult> BenchmarkDispatch(uint64_t frames = 20000, unsigned int cyclesPerFrame = 1000) {
+  std::vector<BenchmarkResult> results;
+  uint64_t instructions = frames * cyclesPerFrame;
+  for (SyntheticRom const& rom : SyntheticRoms()) {
+    Chip8 tables(1);
+    tables.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(RunBenchmark(std::string("dispatch tables ") + rom.name, instructions, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        tables.RunFrame(cyclesPerFrame);
+      }
+    }));
+
+    Chip8 switched(1);
+    switched.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(RunBenchmark(std::string("dispatch switch ") + rom.name, instructions, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        for (unsigned int i = 0; i < cyclesPerFrame; ++i) {
+          switched.CycleSwitch();
+        }
+        switched.TickTimers();
+      }
+    }));
+
+    Chip8 threaded(1);
+    threaded.LoadROM(rom.code.data(), rom.code.size());
+    ThreadedInterpreter interpreter(threaded);
+    results.push_back(RunBenchmark(std::string("dispatch threaded ") + rom.name, instructions, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        interpreter.RunFrame(cyclesPerFrame);
+      }
+    }));
+  }
+  return results;
+}
+
+/**
+ * Emulated instructions/sec of Cycle() on the synthetic ROMs, labelled
+ * "heatmap on" or "heatmap off" by whether this build counts accesses.
+ * The counters are compiled in or out, so run it from one build with
+ * -DCHIP8_MEMORY_HEATMAP and one without and compare the pairs.
+ */
+std::vector<BenchmarkResult> BenchmarkHeatmap(uint64_t frames = 20000, unsigned int cyclesPerFrame = 1000) {
+#ifdef CHIP8_MEMORY_HEATMAP
+  std::string label = "heatmap on ";
+#else
+  std::string label = "heatmap off ";
+#endif
+  std::vector<BenchmarkResult> results;
+  for (SyntheticRom const& rom : SyntheticRoms()) {
+    Chip8 chip8(1);
+    chip8.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(RunBenchmark(label + rom.name, frames * cyclesPerFrame, [&] {
+      for (uint64_t f = 0; f < frames; ++f) {
+        chip8.RunFrame(cyclesPerFrame);
+      }
+    }));
+  }
+  return results;
+}
+
+/**
+ * High-level emulation of well-known guest routines. A signature is a
+ * byte pattern (with a mask for operand nibbles) and a native
+ * implementation. Signatures are matched against memory once, after
+ * the ROM is loaded; when execution reaches a match the native version
+ * runs instead, provided the bytes still match and its entry conditions
+ * hold. A native returns how many guest instructions it stands for, or
+ * 0 to decline and let the interpreter run the instruction.
+ *
+ * Natives only ever replace whole instructions within the current
+ * frame's budget, so the machine state at every frame boundary is the
+ * same as under plain interpretation.
+ */
+enum HleKind {
+  HLE_SUBROUTINE, // entered at the first byte, leaves through its own RET; only run with a return address on the stack
+  HLE_SPIN        // a busy-wait loop starting at the first byte; the stack is not touched
+};
+
+typedef unsigned int (*HleNative)(Chip8& chip8, uint16_t address, unsigned int budget);
+
+struct HleSignature {
+  char const* name;
+  HleKind kind;
+  std::vector<uint8_t> pattern;
+  std::vector<uint8_t> mask; // bits that must match; empty means all of them
+  HleNative native;
+};
+
+/**
+ * BCD score printer: Fx33, F265, then F029/Dyz5/7y05 for each digit and
+ * F229/Dyz5 for the last, then RET. Writes the digits at I, loads them
+ * into V0-V2 and draws them 5 pixels apart.
+ */
+unsigned int HleBcdPrint(Chip8& chip8, uint16_t address, unsigned int budget) {
+  const unsigned int INSTRUCTIONS = 11;
+  uint8_t code[2 * INSTRUCTIONS];
+  chip8.memory.Read(address, code, sizeof(code));
+  uint8_t x = code[0] & 0xFu;
+  uint8_t y = code[6] & 0xFu;
+  uint8_t z = code[7] >> 4u;
+  bool consistent = (code[8] & 0xFu) == y && (code[12] & 0xFu) == y && (code[13] >> 4u) == z
+                    && (code[14] & 0xFu) == y && (code[18] & 0xFu) == y && (code[19] >> 4u) == z;
+  bool scratchClear = chip8.index + 3u <= address || chip8.index >= address + 2u * INSTRUCTIONS;
+  if (!consistent || !scratchClear || chip8.index + 3u > MEMORY_SIZE || budget < INSTRUCTIONS) {
+    return 0;
+  }
+
+  uint8_t value = chip8.registers[x];
+  uint8_t digits[3] = {static_cast<uint8_t>(value / 100), static_cast<uint8_t>((value / 10) % 10), static_cast<uint8_t>(value % 10)};
+  chip8.memory.Write(chip8.index, digits, 3);
+  memcpy(chip8.registers, digits, 3);
+
+  //Drawing goes through the interpreter's own Dxyn, so collisions and clipping match
+  for (unsigned int digit = 0; digit < 3; ++digit) {
+    chip8.index = FONTSET_START_ADDRESS + 5 * chip8.registers[digit];
+    chip8.opcode = 0xD005u | (y << 8u) | (z << 4u);
+    chip8.OP_Dxyn();
+    if (digit < 2) {
+      chip8.registers[y] += 5;
+    }
+  }
+
+  --chip8.sp;
+  chip8.pc = chip8.stack[chip8.sp & 0xFu];
+  chip8.opcode = 0x00EEu;
+  return INSTRUCTIONS;
+}
+
+//Screen wipe: 00E0 then RET
+unsigned int HleClearScreen(Chip8& chip8, uint16_t, unsigned int budget) {
+  if (budget < 2) {
+    return 0;
+  }
+  memset(chip8.video, 0, sizeof(chip8.video));
+  --chip8.sp;
+  chip8.pc = chip8.stack[chip8.sp & 0xFu];
+  chip8.opcode = 0x00EEu;
+  return 2;
+}
+
+/**
+ * Delay loop: Fy07, 3y00, then a jump back to the Fy07. The delay timer
+ * only changes between frames, so while it is non-zero the loop burns
+ * the rest of the frame; the native skips straight to where the
+ * interpreter would have stopped.
+ */
+unsigned int HleDelayLoop(Chip8& chip8, uint16_t address, unsigned int budget) {
+  uint8_t code[6];
+  chip8.memory.Read(address, code, sizeof(code));
+  uint8_t y = code[0] & 0xFu;
+  bool consistent = (code[2] & 0xFu) == y && (((code[4] & 0xFu) << 8u) | code[5]) == address;
+  if (!consistent || chip8.delayTimer == 0 || budget == 0) {
+    return 0;
+  }
+  chip8.registers[y] = chip8.delayTimer;
+  chip8.pc = address + 2 * (budget % 3);
+  chip8.opcode = (budget % 3 == 1) ? static_cast<uint16_t>((code[0] << 8u) | code[1])
+               : (budget % 3 == 2) ? static_cast<uint16_t>((code[2] << 8u) | code[3])
+               : static_cast<uint16_t>((code[4] << 8u) | code[5]);
+  return budget;
+}
+
+std::vector<HleSignature> HleSignatures() {
+  return {
+    {"bcd print", HLE_SUBROUTINE,
+     {0xF0, 0x33, 0xF2, 0x65, 0xF0, 0x29, 0xD0, 0x05, 0x70, 0x05, 0xF1, 0x29,
+      0xD0, 0x05, 0x70, 0x05, 0xF2, 0x29, 0xD0, 0x05, 0x00, 0xEE},
+     {0xF0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0, 0x0F, 0xF0, 0xFF, 0xFF, 0xFF,
+      0xF0, 0x0F, 0xF0, 0xFF, 0xFF, 0xFF, 0xF0, 0x0F, 0xFF, 0xFF},
+     &HleBcdPrint},
+    {"clear screen", HLE_SUBROUTINE, {0x00, 0xE0, 0x00, 0xEE}, {}, &HleClearScreen},
+    {"delay loop", HLE_SPIN,
+     {0xF0, 0x07, 0x30, 0x00, 0x10, 0x00},
+     {0xF0, 0xFF, 0xF0, 0xFF, 0xF0, 0x00},
+     &HleDelayLoop},
+  };
+}
+
+/**
+ * Runs a Chip8 with recognized routines replaced by their natives.
+ * Call Scan() after loading the ROM. In verify mode every native call
+ * is replayed on a copy of the machine by the interpreter and the two
+ * states compared; on a mismatch the interpreted state wins.
+ */
+class HleRuntime {
+  public:
+    struct Stats {
+      uint64_t matches;    // places the signature was found by Scan()
+      uint64_t hits;       // native calls
+      uint64_t cyclesSaved; // guest instructions the natives stood in for
+      uint64_t mismatches; // verify mode: natives that disagreed with the interpreter
+    };
+
+    explicit HleRuntime(Chip8& chip8, std::vector<HleSignature> signatures = HleSignatures())
+      : chip8(chip8), signatures(std::move(signatures)), stats(this->signatures.size(), Stats{}), verify(false) {
+      std::fill(std::begin(entries), std::end(entries), NO_ENTRY);
+    }
+
+    void SetVerify(bool enabled) {
+      verify = enabled;
+    }
+
+    //Finds every signature in memory; returns the number of matches
+    size_t Scan() {
+      size_t found = 0;
+      std::fill(std::begin(entries), std::end(entries), NO_ENTRY);
+      for (Stats& stat : stats) {
+        stat.matches = 0;
+      }
+      for (unsigned int address = 0; address < MEMORY_SIZE; ++address) {
+        for (size_t i = 0; i < signatures.size() && entries[address] == NO_ENTRY; ++i) {
+          if (Matches(signatures[i], address)) {
+            entries[address] = static_cast<uint8_t>(i);
+            ++stats[i].matches;
+            ++found;
+          }
+        }
+      }
+      return found;
+    }
+
+    //Runs one 60 Hz frame: the given number of instructions, then a timer tick
+    void RunFrame(unsigned int instructions) {
+      unsigned int remaining = instructions;
+      while (remaining) {
+        uint8_t entry = entries[chip8.pc & 0xFFFu];
+        if (entry != NO_ENTRY) {
+          unsigned int replaced = Native(entry, remaining);
+          if (replaced) {
+            remaining -= replaced;
+            continue;
+          }
+        }
+        chip8.Cycle();
+        --remaining;
+      }
+      chip8.TickTimers();
+    }
+
+    Stats const& GetStats(size_t signature) const {
+      return stats[signature];
+    }
+
+    void Print() const {
+      for (size_t i = 0; i < signatures.size(); ++i) {
+        Stats const& stat = stats[i];
+        printf("%-16s %6llu found %12llu hits %14llu cycles saved", signatures[i].name,
+               static_cast<unsigned long long>(stat.matches), static_cast<unsigned long long>(stat.hits),
+               static_cast<unsigned long long>(stat.cyclesSaved));
+        if (verify) {
+          printf(" %llu mismatches", static_cast<unsigned long long>(stat.mismatches));
+        }
+        printf("\n");
+      }
+    }
+
+  private:
+    static const uint8_t NO_ENTRY = 0xFF;
+
+    bool Matches(HleSignature const& signature, unsigned int address) const {
+      if (address + signature.pattern.size() > MEMORY_SIZE) {
+        return false;
+      }
+      for (size_t i = 0; i < signature.pattern.size(); ++i) {
+        uint8_t mask = signature.mask.empty() ? 0xFFu : signature.mask[i];
+        if ((chip8.memory[address + i] & mask) != (signature.pattern[i] & mask)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    unsigned int Native(uint8_t entry, unsigned int budget) {
+      HleSignature const& signature = signatures[entry];
+      uint16_t address = chip8.pc & 0xFFFu;
+      //The code may have been overwritten since Scan()
+      if (!Matches(signature, address)) {
+        return 0;
+      }
+      //A subroutine's RET on an empty stack underflows; leave that to the interpreter
+      if (signature.kind == HLE_SUBROUTINE && chip8.sp == 0) {
+        return 0;
+      }
+
+      if (!verify) {
+        unsigned int replaced = signature.native(chip8, address, budget);
+        Count(entry, replaced);
+        return replaced;
+      }
+
+      std::unique_ptr<Chip8> interpreted(new Chip8(chip8));
+      unsigned int replaced = signature.native(chip8, address, budget);
+      if (replaced) {
+        for (unsigned int i = 0; i < replaced; ++i) {
+          interpreted->Cycle();
+        }
+        if (StateHash(*interpreted) != StateHash(chip8) || FrameHash(interpreted->video) != FrameHash(chip8.video)) {
+          ++stats[entry].mismatches;
+          chip8 = *interpreted;
+        }
+      }
+      Count(entry, replaced);
+      return replaced;
+    }
+
+    void Count(uint8_t entry, unsigned int replaced) {
+      if (replaced) {
+        ++stats[entry].hits;
+        stats[entry].cyclesSaved += replaced;
+      }
+    }
+
+    Chip8& chip8;
+    std::vector<HleSignature> signatures;
+    std::vector<Stats> stats;
+    uint8_t entries[4096]; // signature starting at each address, or NO_ENTRY
+    bool verify;
+};
+
+//Frames of the replay that match the recorded video when run at cyclesPerFrame, up to the first that differs
+uint64_t MatchingFrames(Replay const& replay, unsigned int cyclesPerFrame) {
+  Chip8 chip8(replay.seed);
+  chip8.LoadROM(replay.rom.data(), replay.rom.size());
+  for (uint64_t frame = 0; frame < replay.frames.size(); ++frame) {
+    ApplyKeypadMask(replay.frames[frame].keys, chip8.keypad);
+    chip8.RunFrame(cyclesPerFrame);
+    if (FrameHash(chip8.video) != replay.frames[frame].videoHash) {
+      return frame;
+    }
+  }
+  return replay.frames.size();
+}
+
+struct RateResult {
+  std::string name;
+  uint64_t romHash;
+  unsigned int reference; // cycles per frame of the recording
+  unsigned int minimum;   // lowest budget with the same frames; 0 if none was found
+  unsigned int runs;      // replays it took
+  std::string error;      // why the replay could not be searched
+};
+
+/**
+ * Finds the lowest cycles per frame at which a replay still produces
+ * exactly the recorded frames. Budgets are tried downwards from the
+ * recording's own, halving until one diverges, then bisected between
+ * the last match and the first divergence; each run stops at its first
+ * differing frame. Bisection assumes that any budget above a matching
+ * one matches too, which holds for games paced by the delay timer or
+ * waiting on keys, the case this is meant for. Only the video is
+ * compared: what the player cannot see is free to differ.
+ */
+RateResult FindMinimumRate(std::string const& name, Replay const& replay, unsigned int floor = 1) {
+  RateResult result = {name, RomIndex::RomHash(replay.rom.data(), replay.rom.size()), replay.cyclesPerFrame, 0, 0, std::string()};
+  floor = std::max(floor, 1u);
+  if (replay.cyclesPerFrame == 0) {
+    result.error = "recorded with VIP timing";
+    return result;
+  }
+  auto matches = [&](unsigned int cyclesPerFrame) {
+    ++result.runs;
+    return MatchingFrames(replay, cyclesPerFrame) == replay.frames.size();
+  };
+  if (replay.cyclesPerFrame < floor || !matches(replay.cyclesPerFrame)) {
+    result.error = "recording does not replay";
+    return result;
+  }
+
+  unsigned int pass = replay.cyclesPerFrame;
+  unsigned int fail = floor - 1;
+  for (unsigned int budget = pass / 2; budget >= floor; budget /= 2) {
+    if (!matches(budget)) {
+      fail = budget;
+      break;
+    }
+    pass = budget;
+  }
+  while (pass - fail > 1) {
+    unsigned int middle = fail + (pass - fail) / 2;
+    if (matches(middle)) {
+      pass = middle;
+    } else {
+      fail = middle;
+    }
+  }
+  result.minimum = pass;
+  return result;
+}
+
+/**
+ * Runs FindMinimumRate over a set of replay files on every core and
+ * records each ROM's budget in a RomIndex, so schedulers can run it only
+ * as fast as it needs. Workers pull replays from a shared counter.
+ */
+class RateFinder {
+  public:
+    explicit RateFinder(unsigned int workers, unsigned int floor = 1)
+      : workers(workers ? workers : std::max(1u, std::thread::hardware_concurrency())), floor(floor) {}
+
+    void Add(std::string const& filename) {
+      filenames.push_back(filename);
+    }
+
+    //Searches every replay; results are in the order the files were added
+    std::vector<RateResult> Run() {
+      std::vector<RateResult> results(filenames.size());
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> threads;
+      for (unsigned int w = 0; w < workers; ++w) {
+        threads.emplace_back([this, &results, &next] {
+          Replay replay;
+          for (size_t i = next++; i < filenames.size(); i = next++) {
+            if (replay.Load(filenames[i].c_str())) {
+              results[i] = FindMinimumRate(filenames[i], replay, floor);
+            } else {
+              results[i] = RateResult{filenames[i], 0, 0, 0, 0, "unreadable replay"};
+            }
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      return results;
+    }
+
+    //Stores every budget found; a ROM with several replays keeps the highest minimum
+    static void Update(RomIndex& index, std::vector<RateResult> const& results) {
+      std::map<uint64_t, RateResult const*> highest;
+      for (RateResult const& result : results) {
+        RateResult const*& kept = highest[result.romHash];
+        if (result.minimum && (!kept || result.minimum > kept->minimum)) {
+          kept = &result;
+        }
+      }
+      for (auto const& entry : highest) {
+        if (entry.second) {
+          index.Set(entry.first, entry.second->minimum, entry.second->name);
+        }
+      }
+    }
+
+    //One line per replay, then the instructions saved across those that were searched
+    static void Print(std::vector<RateResult> const& results) {
+      uint64_t before = 0, after = 0;
+      for (RateResult const& result : results) {
+        if (!result.error.empty()) {
+          printf("SKIP %s: %s\n", result.name.c_str(), result.error.c_str());
+          continue;
+        }
+        printf("%-40s %6u -> %6u cycles/frame (%u runs)\n", result.name.c_str(), result.reference, result.minimum, result.runs);
+        before += result.reference;
+        after += result.minimum;
+      }
+      if (before) {
+        printf("%.1f%% of the instructions at the recorded rates\n", 100.0 * after / before);
+      }
+    }
+
+  private:
+    unsigned int workers;
+    unsigned int floor;
+    std::vector<std::string> filenames;
+};
+
+/**
+ * The standard host-call handler: times regions with CpuMeter, keeps
+ * sixteen counters, records failed assertions and takes snapshots.
+ * Regions nest and may be re-entered; a BEGIN while the region is open
+ * restarts it, an END without a BEGIN is ignored.
+ */
+class HostCalls : public HostCallHandler {
+  public:
+    struct Region {
+      uint64_t entries;
+      uint64_t nanoseconds;
+      uint64_t start; // CpuMeter tick of the open entry, 0 if closed
+    };
+
+    struct Failure {
+      uint16_t pc;
+      uint8_t reg;
+      uint8_t expected;
+      uint8_t actual;
+    };
+
+    struct Snapshot {
+      uint8_t tag;
+      Chip8State state;
+    };
+
+    HostCalls() : regions{}, counters{} {
+      CpuMeter::NanosecondsPerTick();
+    }
+
+    void OnHostCall(Chip8& chip8, HostCall call, uint8_t operand) override {
+      switch (call) {
+        case HOST_BEGIN:
+          regions[operand].start = CpuMeter::Now();
+          break;
+        case HOST_END:
+          if (regions[operand].start) {
+            regions[operand].nanoseconds += static_cast<uint64_t>((CpuMeter::Now() - regions[operand].start) * CpuMeter::NanosecondsPerTick());
+            regions[operand].start = 0;
+            ++regions[operand].entries;
+          }
+          break;
+        case HOST_COUNT:
+          ++counters[operand];
+          break;
+        case HOST_ADD:
+          counters[operand] += chip8.registers[operand];
+          break;
+        case HOST_ASSERT: {
+          uint8_t expected = chip8.memory[chip8.index & ADDRESS_MASK];
+          if (chip8.registers[operand] != expected) {
+            failures.push_back(Failure{static_cast<uint16_t>(chip8.pc - 2), operand, expected, chip8.registers[operand]});
+          }
+          break;
+        }
+        case HOST_SNAPSHOT:
+          snapshots.emplace_back();
+          snapshots.back().tag = operand;
+          chip8.SaveState(snapshots.back().state);
+          break;
+      }
+    }
+
+    Region const& GetRegion(uint8_t region) const {
+      return regions[region & 0xFu];
+    }
+
+    uint64_t Counter(uint8_t counter) const {
+      return counters[counter & 0xFu];
+    }
+
+    std::vector<Failure> const& Failures() const {
+      return failures;
+    }
+
+    std::vector<Snapshot> const& Snapshots() const {
+      return snapshots;
+    }
+
+    void Clear() {
+      *this = HostCalls();
+    }
+
+    //Adds every used region and counter to rom.region.<n>.{entries,ns} and rom.counter.<n>
+    void Publish(MetricsRegistry& metrics) const {
+      for (unsigned int n = 0; n < 16; ++n) {
+        if (regions[n].entries) {
+          metrics.Counter("rom.region." + std::to_string(n) + ".entries").fetch_add(regions[n].entries);
+          metrics.Counter("rom.region." + std::to_string(n) + ".ns").fetch_add(regions[n].nanoseconds);
+        }
+        if (counters[n]) {
+          metrics.Counter("rom.counter." + std::to_string(n)).fetch_add(counters[n]);
+        }
+      }
+      metrics.Counter("rom.assert_failures").fetch_add(failures.size());
+    }
+
+    void Print() const {
+      for (unsigned int n = 0; n < 16; ++n) {
+        if (regions[n].entries) {
+          printf("region %-2u %10llu entries %12.3f ms %10.1f ns/entry\n", n, static_cast<unsigned long long>(regions[n].entries),
+                 regions[n].nanoseconds / 1e6, static_cast<double>(regions[n].nanoseconds) / regions[n].entries);
+        }
+      }
+      for (unsigned int n = 0; n < 16; ++n) {
+        if (counters[n]) {
+          printf("counter %-2u %llu\n", n, static_cast<unsigned long long>(counters[n]));
+        }
+      }
+      for (Failure const& failure : failures) {
+        printf("assert failed at %03x: V%X = %u, expected %u\n", failure.pc, failure.reg, failure.actual, failure.expected);
+      }
+    }
+
+  private:
+    Region regions[16];
+    uint64_t counters[16];
+    std::vector<Failure> failures;
+    std::vector<Snapshot> snapshots;
+};
+
+/**
+ * The "phases" synthetic ROM with host calls detached and attached, then
+ * the time its own markers measured for each phase. Operations are
+ * instructions for the whole runs and region entries for the phases.
+ */
+std::vector<BenchmarkResult> BenchmarkHostCalls(uint64_t frames = 20000, unsigned int cyclesPerFrame = 1000) {
+  SyntheticRom rom = SyntheticRomNamed("phases");
+  if (rom.code.empty()) {
+    return {};
+  }
+  std::vector<BenchmarkResult> results;
+  uint64_t instructions = frames * cyclesPerFrame;
+
+  Chip8 detached(1);
+  detached.LoadROM(rom.code.data(), rom.code.size());
+  results.push_back(RunBenchmark("host calls detached", instructions, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      detached.RunFrame(cyclesPerFrame);
+    }
+  }));
+
+  HostCalls hooks;
+  Chip8 attached(1);
+  attached.LoadROM(rom.code.data(), rom.code.size());
+  attached.hostCalls = &hooks;
+  results.push_back(RunBenchmark("host calls attached", instructions, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      attached.RunFrame(cyclesPerFrame);
+    }
+  }));
+
+  char const* const phases[] = {"alu", "draw", "memory"};
+  for (unsigned int region = 1; region <= 3; ++region) {
+    HostCalls::Region const& measured = hooks.GetRegion(region);
+    results.push_back(BenchmarkResult{std::string("phase ") + phases[region - 1], measured.entries, measured.nanoseconds / 1e9});
+  }
+  return results;
+}
+
+/**
+ * One bit per guest address, for breakpoints and watchpoints.
+ */
+struct AddressBitmap {
+  uint64_t bits[MEMORY_SIZE / 64] = {};
+
+  void Set(unsigned int address) {
+    bits[(address & ADDRESS_MASK) / 64] |= 1ull << (address % 64);
+  }
+
+  void Clear(unsigned int address) {
+    bits[(address & ADDRESS_MASK) / 64] &= ~(1ull << (address % 64));
+  }
+
+  bool Test(unsigned int address) const {
+    return (bits[(address & ADDRESS_MASK) / 64] >> (address % 64)) & 1u;
+  }
+
+  bool Empty() const {
+    for (uint64_t word : bits) {
+      if (word) return false;
+    }
+    return true;
+  }
+
+  void Reset() {
+    memset(bits, 0, sizeof(bits));
+  }
+};
+
+enum DebugCommandKind {
+  DEBUG_CONNECT,    // a debugger connected; halt
+  DEBUG_PACKET,     // one RSP packet, checksum verified and unescaped
+  DEBUG_INTERRUPT,  // ^C from the debugger
+  DEBUG_DISCONNECT  // the debugger is gone; resume and detach
+};
+
+struct DebugCommand {
+  DebugCommandKind kind;
+  std::string packet;
+};
+
+/**
+ * What the debugger connection thread hands to the emulator thread.
+ * Everything that touches the machine runs on the emulator thread,
+ * between instructions, so the Chip8 itself needs no locking.
+ */
+class DebugCommandQueue {
+  public:
+    void Push(DebugCommand command) {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(command));
+      wake.notify_one();
+    }
+
+    bool TryPop(DebugCommand& command) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (queue.empty()) {
+        return false;
+      }
+      command = std::move(queue.front());
+      queue.pop_front();
+      return true;
+    }
+
+    DebugCommand WaitPop() {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this] { return !queue.empty(); });
+      DebugCommand command = std::move(queue.front());
+      queue.pop_front();
+      return command;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<DebugCommand> queue;
+};
+
+//Frames an RSP payload as $payload#checksum, escaping the characters the protocol reserves
+std::string RspFrame(std::string const& payload) {
+  std::string frame = "$";
+  uint8_t checksum = 0;
+  for (char c : payload) {
+    if (c == '$' || c == '#' || c == '}' || c == '*') {
+      frame += '}';
+      checksum += '}';
+      c ^= 0x20;
+    }
+    frame += c;
+    checksum += static_cast<uint8_t>(c);
+  }
+  char digits[4];
+  snprintf(digits, sizeof(digits), "#%02x", checksum);
+  return frame + digits;
+}
+
+/**
+ * GDB remote serial protocol server for one Chip8 on a loopback TCP
+ * port, for `target remote localhost:<port>` and other RSP front ends.
+ *
+ * Registers are numbered 0-15 for V0-VF, 16 I, 17 pc, 18 sp, 19 the
+ * delay timer, 20 the sound timer and 21-36 the stack, little-endian,
+ * and described to the client by qXfer target.xml. Z0 and Z1
+ * breakpoints, reported as swbreak and hwbreak stops, and Z2-Z4
+ * watchpoints on I-relative accesses are AddressBitmaps.
+ *
+ * The connection thread only parses packets and queues them; the
+ * emulator thread runs them from RunFrame(). While no debugger is
+ * attached RunFrame() is one atomic load and Chip8::RunFrame, with no
+ * per-instruction checks. Attached, it checks the bitmaps before each
+ * instruction and drains the queue once per frame, and while halted it
+ * blocks, so the caller's frame loop stops with the machine.
+ */
+class GdbStub {
+  public:
+    static const unsigned int REGISTER_COUNT = 37;
+
+    explicit GdbStub(Chip8& chip8)
+      : chip8(chip8), listenFd(-1), clientFd(-1), wakeFds{-1, -1}, boundPort(0), running(false), active(false),
+        halted(false), stepping(false), resumed(false), watching(false), stopReply("S05") {}
+
+    ~GdbStub() {
+      Stop();
+    }
+
+    //Listens on 127.0.0.1; port 0 picks a free port, see Port()
+    bool Listen(uint16_t port) {
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = htons(port);
+      socklen_t length = sizeof(address);
+      int reuse = 1;
+      listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listenFd < 0 || setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+          || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, 1) != 0
+          || getsockname(listenFd, reinterpret_cast<sockaddr*>(&address), &length) != 0
+          || pipe2(wakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        Stop();
+        return false;
+      }
+      boundPort = ntohs(address.sin_port);
+      running = true;
+      thread = std::thread(&GdbStub::Loop, this);
+      return true;
+    }
+
+    void Stop() {
+      if (running.exchange(false)) {
+        char byte = 0;
+        if (write(wakeFds[1], &byte, 1) < 0) {
+          //Pipe already full: the thread has a wakeup pending anyway
+        }
+        thread.join();
+      }
+      for (int& fd : wakeFds) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+      }
+      if (listenFd >= 0) {
+        close(listenFd);
+        listenFd = -1;
+      }
+    }
+
+    uint16_t Port() const {
+      return boundPort;
+    }
+
+    //True from a debugger connecting until RunFrame() has handled its disconnect
+    bool Attached() const {
+      return active.load(std::memory_order_acquire);
+    }
+
+    //Runs one frame of the given number of instructions, stopping wherever the debugger says
+    void RunFrame(unsigned int instructions) {
+      if (!active.load(std::memory_order_acquire)) {
+        chip8.RunFrame(instructions);
+        return;
+      }
+      Serve();
+      unsigned int done = 0;
+      while (done < instructions) {
+        if (halted) {
+          Serve();
+          continue;
+        }
+        if (!resumed && (breakpoints.Test(chip8.pc) || hardwareBreakpoints.Test(chip8.pc))) {
+          Halt(breakpoints.Test(chip8.pc) ? "T05swbreak:;" : "T05hwbreak:;");
+          continue;
+        }
+        resumed = false;
+
+        unsigned int accessSize = 0;
+        bool accessWrites = false;
+        if (watching) {
+          Accesses(chip8.memory.Word(chip8.pc & ADDRESS_MASK), accessSize, accessWrites);
+        }
+        uint16_t accessStart = chip8.index;
+        chip8.Cycle();
+        ++done;
+
+        if (accessSize) {
+          AddressBitmap const& watched = accessWrites ? writeWatch : readWatch;
+          for (unsigned int i = 0; i < accessSize; ++i) {
+            unsigned int address = (accessStart + i) & ADDRESS_MASK;
+            if (watched.Test(address)) {
+              char reply[32];
+              char const* kind = writeWatch.Test(address) && readWatch.Test(address) ? "awatch" : accessWrites ? "watch" : "rwatch";
+              snprintf(reply, sizeof(reply), "T05%s:%x;", kind, address);
+              Halt(reply);
+              break;
+            }
+          }
+        }
+        if (stepping && !halted) {
+          stepping = false;
+          Halt("T05thread:1;");
+        }
+      }
+      chip8.TickTimers();
+    }
+
+  private:
+    //Handles queued commands; while halted, waits for the one that resumes
+    void Serve() {
+      for (;;) {
+        DebugCommand command;
+        if (halted) {
+          command = commands.WaitPop();
+        } else if (!commands.TryPop(command)) {
+          return;
+        }
+        switch (command.kind) {
+          case DEBUG_CONNECT:
+            ResetSession();
+            halted = true;
+            stopReply = "S05";
+            break;
+          case DEBUG_DISCONNECT:
+            ResetSession();
+            active.store(false, std::memory_order_release);
+            return;
+          case DEBUG_INTERRUPT:
+            if (!halted) {
+              Halt("T02thread:1;");
+            }
+            break;
+          case DEBUG_PACKET:
+            HandlePacket(command.packet);
+            break;
+        }
+      }
+    }
+
+    void ResetSession() {
+      breakpoints.Reset();
+      hardwareBreakpoints.Reset();
+      writeWatch.Reset();
+      readWatch.Reset();
+      watching = false;
+      halted = false;
+      stepping = false;
+      resumed = false;
+    }
+
+    void Halt(char const* reply) {
+      halted = true;
+      stopReply = reply;
+      Send(stopReply);
+    }
+
+    void HandlePacket(std::string const& packet) {
+      char kind = packet.empty() ? '\0' : packet[0];
+      char const* args = packet.c_str() + (packet.empty() ? 0 : 1);
+      switch (kind) {
+        case '?':
+          Send(stopReply);
+          return;
+        case 'g': {
+          std::string reply;
+          for (unsigned int n = 0; n < REGISTER_COUNT; ++n) {
+            AppendRegister(reply, n);
+          }
+          Send(reply);
+          return;
+        }
+        case 'G': {
+          size_t offset = 0;
+          for (unsigned int n = 0; n < REGISTER_COUNT && offset + 2 * RegisterSize(n) <= strlen(args); ++n) {
+            SetRegister(n, ParseLittleEndian(args + offset, RegisterSize(n)));
+            offset += 2 * RegisterSize(n);
+          }
+          Send("OK");
+          return;
+        }
+        case 'p': {
+          unsigned long n = strtoul(args, nullptr, 16);
+          std::string reply;
+          if (n < REGISTER_COUNT) {
+            AppendRegister(reply, static_cast<unsigned int>(n));
+          }
+          Send(n < REGISTER_COUNT ? reply : "E01");
+          return;
+        }
+        case 'P': {
+          char* value;
+          unsigned long n = strtoul(args, &value, 16);
+          if (n >= REGISTER_COUNT || *value != '=') {
+            Send("E01");
+            return;
+          }
+          SetRegister(static_cast<unsigned int>(n), ParseLittleEndian(value + 1, RegisterSize(static_cast<unsigned int>(n))));
+          Send("OK");
+          return;
+        }
+        case 'm':
+        case 'M': {
+          char* end;
+          unsigned long address = strtoul(args, &end, 16);
+          unsigned long length = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+          if (address > MEMORY_SIZE || length > MEMORY_SIZE - address) {
+            Send("E01");
+            return;
+          }
+          if (kind == 'm') {
+            std::string reply;
+            for (unsigned long i = 0; i < length; ++i) {
+              AppendHex(reply, chip8.memory[static_cast<unsigned int>(address + i)]);
+            }
+            Send(reply);
+          } else {
+            char const* data = strchr(end, ':');
+            if (!data || strlen(data + 1) < 2 * length) {
+              Send("E01");
+              return;
+            }
+            for (unsigned long i = 0; i < length; ++i) {
+              chip8.memory.Write(static_cast<unsigned int>(address + i), static_cast<uint8_t>(ParseLittleEndian(data + 1 + 2 * i, 1)));
+            }
+            Send("OK");
+          }
+          return;
+        }
+        case 'c':
+        case 's':
+          if (*args) {
+            chip8.pc = static_cast<uint16_t>(strtoul(args, nullptr, 16));
+          }
+          halted = false;
+          resumed = true;
+          stepping = kind == 's';
+          return;
+        case 'Z':
+        case 'z': {
+          char* end;
+          unsigned long type = strtoul(args, &end, 16);
+          unsigned long address = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+          unsigned long length = *end == ',' ? strtoul(end + 1, &end, 16) : 1;
+          if (type > 4 || address >= MEMORY_SIZE) {
+            Send(type > 4 ? "" : "E01");
+            return;
+          }
+          AddressBitmap& code = type == 0 ? breakpoints : hardwareBreakpoints;
+          for (unsigned long i = 0; i < (type < 2 ? 1 : std::max(length, 1ul)); ++i) {
+            unsigned int target = static_cast<unsigned int>(address + i);
+            if (type < 2) {
+              kind == 'Z' ? code.Set(target) : code.Clear(target);
+            }
+            if (type == 2 || type == 4) {
+              kind == 'Z' ? writeWatch.Set(target) : writeWatch.Clear(target);
+            }
+            if (type == 3 || type == 4) {
+              kind == 'Z' ? readWatch.Set(target) : readWatch.Clear(target);
+            }
+          }
+          watching = !writeWatch.Empty() || !readWatch.Empty();
+          Send("OK");
+          return;
+        }
+        case 'D':
+          ResetSession();
+          Send("OK");
+          return;
+        case 'k':
+          //No reply; the connection thread sees the hangup and queues the disconnect
+          ResetSession();
+          HangUp();
+          return;
+        case 'H':
+        case 'T':
+          Send("OK");
+          return;
+        case 'q':
+          Send(Query(packet));
+          return;
+        default:
+          Send("");
+          return;
+      }
+    }
+
+    std::string Query(std::string const& packet) {
+      if (packet.rfind("qSupported", 0) == 0) {
+        return "PacketSize=1000;qXfer:features:read+;swbreak+;hwbreak+";
+      }
+      if (packet == "qAttached") {
+        return "1";
+      }
+      if (packet == "qC") {
+        return "QC1";
+      }
+      if (packet == "qfThreadInfo") {
+        return "m1";
+      }
+      if (packet == "qsThreadInfo") {
+        return "l";
+      }
+      std::string const xfer = "qXfer:features:read:target.xml:";
+      if (packet.rfind(xfer, 0) == 0) {
+        char* end;
+        unsigned long offset = strtoul(packet.c_str() + xfer.size(), &end, 16);
+        unsigned long length = *end == ',' ? strtoul(end + 1, nullptr, 16) : 0;
+        std::string xml = TargetXml();
+        if (offset >= xml.size()) {
+          return "l";
+        }
+        std::string chunk = xml.substr(offset, length);
+        return (offset + chunk.size() < xml.size() ? "m" : "l") + chunk;
+      }
+      return "";
+    }
+
+    static std::string TargetXml() {
+      std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                        "<target version=\"1.0\"><feature name=\"org.chip8.cpu\">";
+      for (unsigned int n = 0; n < REGISTER_COUNT; ++n) {
+        char const* type = n == 16 ? "data_ptr" : n == 17 ? "code_ptr" : "uint";
+        xml += "<reg name=\"" + RegisterName(n) + "\" bitsize=\"" + std::to_string(8 * RegisterSize(n)) + "\" type=\"" + type
+               + (n == 16 || n == 17 ? "" : std::to_string(8 * RegisterSize(n))) + "\"/>";
+      }
+      return xml + "</feature></target>";
+    }
+
+    static std::string RegisterName(unsigned int n) {
+      static char const* const named[] = {"i", "pc", "sp", "dt", "st"};
+      char name[8];
+      if (n < 16) {
+        snprintf(name, sizeof(name), "v%x", n);
+      } else if (n < 21) {
+        return named[n - 16];
+      } else {
+        snprintf(name, sizeof(name), "s%u", n - 21);
+      }
+      return name;
+    }
+
+    static unsigned int RegisterSize(unsigned int n) {
+      return n == 16 || n == 17 || n >= 21 ? 2 : 1;
+    }
+
+    void AppendRegister(std::string& out, unsigned int n) const {
+      uint16_t value = n < 16 ? chip8.registers[n] : n == 16 ? chip8.index : n == 17 ? chip8.pc : n == 18 ? chip8.sp
+                     : n == 19 ? chip8.delayTimer : n == 20 ? chip8.soundTimer : chip8.stack[n - 21];
+      for (unsigned int i = 0; i < RegisterSize(n); ++i) {
+        AppendHex(out, static_cast<uint8_t>(value >> (8 * i)));
+      }
+    }
+
+    void SetRegister(unsigned int n, uint16_t value) {
+      if (n < 16) {
+        chip8.registers[n] = static_cast<uint8_t>(value);
+      } else if (n == 16) {
+        chip8.index = value;
+      } else if (n == 17) {
+        chip8.pc = value;
+      } else if (n == 18) {
+        chip8.sp = static_cast<uint8_t>(value);
+      } else if (n == 19) {
+        chip8.delayTimer = static_cast<uint8_t>(value);
+      } else if (n == 20) {
+        chip8.soundTimer = static_cast<uint8_t>(value);
+      } else {
+        chip8.stack[n - 21] = value;
+      }
+    }
+
+    static void AppendHex(std::string& out, uint8_t byte) {
+      static char const digits[] = "0123456789abcdef";
+      out += digits[byte >> 4u];
+      out += digits[byte & 0xFu];
+    }
+
+    static uint16_t ParseLittleEndian(char const* hex, unsigned int bytes) {
+      uint16_t value = 0;
+      for (unsigned int i = 0; i < bytes; ++i) {
+        char pair[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        value |= static_cast<uint16_t>(strtoul(pair, nullptr, 16) << (8 * i));
+      }
+      return value;
+    }
+
+    //Bytes the instruction reads or writes starting at I, if any
+    static void Accesses(uint16_t op, unsigned int& size, bool& writes) {
+      unsigned int x = (op & 0x0F00u) >> 8u;
+      size = 0;
+      writes = false;
+      if ((op & 0xF000u) == 0xD000u) {
+        size = op & 0x000Fu;
+      } else if ((op & 0xF0FFu) == 0xF033u) {
+        size = 3;
+        writes = true;
+      } else if ((op & 0xF0FFu) == 0xF055u) {
+        size = x + 1;
+        writes = true;
+      } else if ((op & 0xF0FFu) == 0xF065u) {
+        size = x + 1;
+      }
+    }
+
+    void Send(std::string const& payload) {
+      SendRaw(RspFrame(payload));
+    }
+
+    void SendRaw(std::string const& bytes) {
+      std::lock_guard<std::mutex> lock(sendMutex);
+      if (clientFd >= 0 && send(clientFd, bytes.data(), bytes.size(), MSG_NOSIGNAL) < 0) {
+        //The connection thread sees the hangup and queues the disconnect
+      }
+    }
+
+    //Ends the session from the emulator thread; the fd itself is closed by the connection thread
+    void HangUp() {
+      std::lock_guard<std::mutex> lock(sendMutex);
+      if (clientFd >= 0) {
+        shutdown(clientFd, SHUT_RDWR);
+      }
+    }
+
+    void CloseClient() {
+      std::lock_guard<std::mutex> lock(sendMutex);
+      if (clientFd >= 0) {
+        close(clientFd);
+        clientFd = -1;
+      }
+    }
+
+    //Connection thread: accepts one debugger at a time and queues its packets
+    void Loop() {
+      std::string packet;
+      bool inPacket = false;
+      while (running) {
+        bool accepting = clientFd < 0;
+        bool draining = accepting && active.load(std::memory_order_acquire); // last session not yet torn down
+        pollfd fds[2] = {{wakeFds[0], POLLIN, 0}, {accepting ? listenFd : clientFd, static_cast<short>(draining ? 0 : POLLIN), 0}};
+        if (poll(fds, 2, draining ? 10 : -1) <= 0 || (fds[0].revents & POLLIN)) {
+          continue;
+        }
+
+        if (accepting) {
+          int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+          if (fd >= 0) {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            {
+              std::lock_guard<std::mutex> lock(sendMutex);
+              clientFd = fd;
+            }
+            active.store(true, std::memory_order_release);
+            commands.Push(DebugCommand{DEBUG_CONNECT, std::string()});
+          }
+          continue;
+        }
+
+        char bytes[4096];
+        ssize_t count = recv(clientFd, bytes, sizeof(bytes), 0);
+        if (count <= 0) {
+          CloseClient();
+          commands.Push(DebugCommand{DEBUG_DISCONNECT, std::string()});
+          inPacket = false;
+          continue;
+        }
+        for (ssize_t i = 0; i < count; ++i) {
+          char c = bytes[i];
+          if (!inPacket) {
+            if (c == '$') {
+              inPacket = true;
+              packet.clear();
+            } else if (c == 0x03) {
+              commands.Push(DebugCommand{DEBUG_INTERRUPT, std::string()});
+            }
+            continue;
+          }
+          packet += c;
+          size_t hash = packet.size() >= 3 ? packet.size() - 3 : std::string::npos;
+          if (hash == std::string::npos || packet[hash] != '#') {
+            continue;
+          }
+          inPacket = false;
+          std::string payload;
+          uint8_t checksum = 0;
+          bool escaped = false;
+          for (size_t j = 0; j < hash; ++j) {
+            checksum += static_cast<uint8_t>(packet[j]);
+            if (packet[j] == '}' && !escaped) {
+              escaped = true;
+              continue;
+            }
+            payload += escaped ? static_cast<char>(packet[j] ^ 0x20) : packet[j];
+            escaped = false;
+          }
+          if (strtoul(packet.substr(hash + 1).c_str(), nullptr, 16) != checksum) {
+            SendRaw("-");
+            continue;
+          }
+          SendRaw("+");
+          commands.Push(DebugCommand{DEBUG_PACKET, payload});
+        }
+      }
+      if (clientFd >= 0) {
+        CloseClient();
+        commands.Push(DebugCommand{DEBUG_DISCONNECT, std::string()});
+      }
+    }
+
+    Chip8& chip8;
+    int listenFd;
+    int clientFd; // written by the connection thread under sendMutex
+    int wakeFds[2];
+    uint16_t boundPort;
+    std::thread thread;
+    std::mutex sendMutex;
+    DebugCommandQueue commands;
+    std::atomic<bool> running;
+    std::atomic<bool> active;
+
+    //Emulator thread only
+    AddressBitmap breakpoints;         // Z0
+    AddressBitmap hardwareBreakpoints; // Z1
+    AddressBitmap writeWatch;
+    AddressBitmap readWatch;
+    bool halted;
+    bool stepping;
+    bool resumed;   // skip the breakpoint check on the first instruction after c/s
+    bool watching;  // any watchpoint set
+    std::string stopReply;
+};
+
+/**
+ * Minimal RSP client for scripting a GdbStub: sends packets, waits for
+ * acknowledgements and replies, and acknowledges what it receives.
+ */
+class GdbClient {
+  public:
+    GdbClient() : fd(-1) {}
+
+    ~GdbClient() {
+      if (fd >= 0) close(fd);
+    }
+
+    bool Connect(uint16_t port) {
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = htons(port);
+      fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      int noDelay = 1;
+      return fd >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) == 0
+             && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    }
+
+    //Sends one packet and waits for the stub to acknowledge it
+    bool Send(std::string const& payload) {
+      std::string frame = RspFrame(payload);
+      char ack;
+      do {
+        if (send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) < 0) {
+          return false;
+        }
+        do {
+          if (recv(fd, &ack, 1, 0) != 1) {
+            return false;
+          }
+        } while (ack != '+' && ack != '-');
+      } while (ack == '-');
+      return true;
+    }
+
+    //Blocks for the next packet from the stub; false once it is gone
+    bool Receive(std::string& payload) {
+      char c;
+      do {
+        if (recv(fd, &c, 1, 0) != 1) {
+          return false;
+        }
+      } while (c != '$');
+      payload.clear();
+      bool escaped = false;
+      while (recv(fd, &c, 1, 0) == 1 && c != '#') {
+        if (c == '}' && !escaped) {
+          escaped = true;
+          continue;
+        }
+        payload += escaped ? static_cast<char>(c ^ 0x20) : c;
+        escaped = false;
+      }
+      char checksum[2];
+      return c == '#' && recv(fd, checksum, 2, MSG_WAITALL) == 2 && send(fd, "+", 1, MSG_NOSIGNAL) == 1;
+    }
+
+    //Sends a packet and returns its reply, or "E.." if the connection failed
+    std::string Command(std::string const& payload) {
+      std::string reply;
+      return Send(payload) && Receive(reply) ? reply : "E.. disconnected";
+    }
+
+    void Interrupt() {
+      char const byte = 0x03;
+      if (send(fd, &byte, 1, MSG_NOSIGNAL) < 0) {
+        //Caller notices on the next Receive()
+      }
+    }
+
+  private:
+    int fd;
+};
+
+/**
+ * Cost of the debugger hooks on the ALU ROM: plain Chip8::RunFrame, a
+ * listening GdbStub with nobody attached, and an attached debugger that
+ * has continued with a breakpoint and a watchpoint set that never hit.
+ */
+std::vector<BenchmarkResult> BenchmarkGdbStub(uint64_t frames = 20000, unsigned int cyclesPerFrame = 1000) {
+  SyntheticRom rom = SyntheticRomNamed("alu");
+  if (rom.code.empty()) {
+    return {};
+  }
+  std::vector<BenchmarkResult> results;
+  uint64_t instructions = frames * cyclesPerFrame;
+
+  Chip8 direct(1);
+  direct.LoadROM(rom.code.data(), rom.code.size());
+  results.push_back(RunBenchmark("gdb none", instructions, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      direct.RunFrame(cyclesPerFrame);
+    }
+  }));
+
+  Chip8 chip8(1);
+  chip8.LoadROM(rom.code.data(), rom.code.size());
+  GdbStub stub(chip8);
+  if (!stub.Listen(0)) {
+    return results;
+  }
+  results.push_back(RunBenchmark("gdb detached", instructions, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      stub.RunFrame(cyclesPerFrame);
+    }
+  }));
+
+  GdbClient client;
+  if (!client.Connect(stub.Port())) {
+    return results;
+  }
+  std::thread debugger([&] {
+    client.Command("Z0,fff,2");
+    client.Command("Z2,ffe,1");
+    client.Send("c");
+  });
+  while (!stub.Attached()) {
+    std::this_thread::yield();
+  }
+  results.push_back(RunBenchmark("gdb attached", instructions, [&] {
+    for (uint64_t f = 0; f < frames; ++f) {
+      stub.RunFrame(cyclesPerFrame);
+    }
+  }));
+  debugger.join();
+  stub.Stop();
+  return results;
+}
+
+struct EnergyResult {
+  std::string name;
+  uint64_t frames;
+  uint64_t instructions;
+  double seconds;
+  double joules;
+
+  double JoulesPerFrame() const {
+    return frames ? joules / frames : 0;
+  }
+
+  double JoulesPerMillionInstructions() const {
+    return instructions ? joules * 1e6 / instructions : 0;
+  }
+
+  double Watts() const {
+    return seconds > 0 ? joules / seconds : 0;
+  }
+};
+
+//Runs frames of the given frame body, flat out or paced at 60 Hz, and meters the package energy
+template <typename Frame>
+EnergyResult MeasureEnergy(EnergyMeter& meter, std::string const& name, uint64_t frames, unsigned int cyclesPerFrame, bool paced, Frame frame) {
+  RealClock clock;
+  Clock::Duration start = clock.Now();
+  uint64_t before = meter.Microjoules();
+  for (uint64_t f = 0; f < frames; ++f) {
+    frame();
+    if (paced) {
+      clock.SleepUntil(start + Clock::Duration(static_cast<Clock::Duration::rep>((f + 1) * 1000000000ull / TIMER_HZ)));
+    }
+  }
+  uint64_t used = meter.Microjoules() - before;
+  double seconds = std::chrono::duration<double>(clock.Now() - start).count();
+  return EnergyResult{name, frames, frames * cyclesPerFrame, seconds, used / 1e6};
+}
+
+/**
+ * Package energy per emulated frame and per million guest instructions
+ * for each dispatch backend on the ALU ROM, run flat out and paced at
+ * 60 Hz as a kiosk would. Returns nothing where RAPL is not readable.
+ * Unpaced figures are dominated by the emulator, paced ones mostly by
+ * the idle package between frames.
+ */
+std::vector<EnergyResult> BenchmarkEnergy(uint64_t frames = 20000, uint64_t pacedFrames = 120, unsigned int cyclesPerFrame = 1000) {
+  EnergyMeter meter;
+  if (!meter.Available()) {
+    return {};
+  }
+  SyntheticRom rom = SyntheticRomNamed("alu");
+  if (rom.code.empty()) {
+    return {};
+  }
+  std::vector<EnergyResult> results;
+  for (bool paced : {false, true}) {
+    uint64_t count = paced ? pacedFrames : frames;
+    std::string mode = paced ? " paced" : " unpaced";
+
+    Chip8 tables(1);
+    tables.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(MeasureEnergy(meter, "energy tables" + mode, count, cyclesPerFrame, paced, [&] {
+      tables.RunFrame(cyclesPerFrame);
+    }));
+
+    Chip8 switched(1);
+    switched.LoadROM(rom.code.data(), rom.code.size());
+    results.push_back(MeasureEnergy(meter, "energy switch" + mode, count, cyclesPerFrame, paced, [&] {
+      for (unsigned int i = 0; i < cyclesPerFrame; ++i) {
+        switched.CycleSwitch();
+      }
+      switched.TickTimers();
+    }));
+
+    Chip8 threaded(1);
+    threaded.LoadROM(rom.code.data(), rom.code.size());
+    ThreadedInterpreter interpreter(threaded);
+    results.push_back(MeasureEnergy(meter, "energy threaded" + mode, count, cyclesPerFrame, paced, [&] {
+      interpreter.RunFrame(cyclesPerFrame);
+    }));
+  }
+  return results;
+}
+
+void PrintEnergy(EnergyResult const& result) {
+  printf("%-32s %10.3f ms %8.2f W %10.3f mJ/frame %10.3f mJ/Minstr\n", result.name.c_str(), result.seconds * 1000.0,
+         result.Watts(), result.JoulesPerFrame() * 1e3, result.JoulesPerMillionInstructions() * 1e3);
+}